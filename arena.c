@@ -0,0 +1,197 @@
+// Bump allocator
+//
+// An arena hands out memory from a list of large chunks by bumping a
+// pointer. Nothing is freed individually; areset() takes the whole
+// arena back in O(1) by rewinding to its first chunk, and keeps the
+// chunks around to be reused.
+//
+// acheckpoint() marks a point to come back to with arollback(), which
+// gives back everything allocated since and undoes every write noted
+// since with ajournal(). Code that changes memory which may predate a
+// checkpoint notes the bytes it is about to overwrite with ajournal(),
+// so that a rollback only costs as much as what it undoes.
+// Checkpoints nest.
+#ifndef _ARENA_C
+#define _ARENA_C
+#include "common.h"
+
+#define ARENACHUNK (64 * 1024)
+#define ARENAMAXCHUNK (16 * 1024 * 1024)
+#define ARENAALIGN 16
+
+struct _chunk {
+  struct _chunk *next;
+  size_t size;
+  char data[];
+};
+typedef struct _chunk chunk;
+
+typedef struct {
+  chunk *cur;         // As in the arena when the checkpoint was made
+  size_t used;
+  size_t inuse;
+  size_t jlen;        // Length of the journal then
+} amark;
+
+typedef struct {
+  chunk *first;
+  chunk *cur;
+  size_t used;        // Bytes used in cur
+  size_t inuse;       // Bytes handed out since the last reset,
+                      // including padding and the unused tails of
+                      // chunks that were skipped over
+  size_t highwater;   // Largest value inuse has reached
+  size_t reserved;    // Total size of all chunks
+
+  amark *marks;       // Open checkpoints, innermost last
+  size_t nmarks, markcap;
+  char *journal;      // Undo records, each the overwritten bytes padded
+  size_t jlen, jcap;  // to JALIGN, then their address and length
+} arena;
+
+#define JALIGN sizeof(size_t)
+
+static chunk *_newchunk(arena *a, size_t n) {
+  chunk *c;
+  size_t size;
+
+  size = a->cur ? a->cur->size << 1 : ARENACHUNK;
+  if (size > ARENAMAXCHUNK) size = ARENAMAXCHUNK;
+  if (size < n) size = n;
+  c = malloc(sizeof(chunk) + size);
+  c->size = size;
+  c->next = NULL;
+  a->reserved += size;
+  return c;
+}
+
+// Allocate n zeroed bytes from a.
+void *aalloc(arena *a, size_t n) {
+  chunk *c;
+  void *p;
+
+  n = (n + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+  if (!a->cur) {
+    a->first = a->cur = _newchunk(a, n);
+    a->used = 0;
+  }
+
+  if (a->used + n > a->cur->size) {
+    a->inuse += a->cur->size - a->used;
+    // Move on to the next chunk, reusing one left over from before the
+    // last reset if it is large enough
+    c = a->cur->next;
+    if (!c || c->size < n) {
+      c = _newchunk(a, n);
+      c->next = a->cur->next;
+      a->cur->next = c;
+    }
+    a->cur = c;
+    a->used = 0;
+  }
+
+  p = a->cur->data + a->used;
+  a->used += n;
+  a->inuse += n;
+  if (a->inuse > a->highwater) a->highwater = a->inuse;
+  memset(p, 0, n);
+  return p;
+}
+
+// Grow an array allocated from a, from oldn to newn bytes. The old
+// array is simply abandoned.
+void *arealloc(arena *a, void *p, size_t oldn, size_t newn) {
+  void *p1;
+  p1 = aalloc(a, newn);
+  if (p) memcpy(p1, p, oldn < newn ? oldn : newn);
+  return p1;
+}
+
+char *astrdup(arena *a, char *s) {
+  char *s1;
+  s1 = aalloc(a, strlen(s) + 1);
+  strcpy(s1, s);
+  return s1;
+}
+
+// Take everything back, dropping any checkpoints
+void areset(arena *a) {
+  a->cur = a->first;
+  a->used = 0;
+  a->inuse = 0;
+  a->nmarks = 0;
+  a->jlen = 0;
+}
+
+// Give all of a's memory back
+void afree(arena *a) {
+  chunk *c, *c1;
+  for (c = a->first; c; c = c1) {
+    c1 = c->next;
+    free(c);
+  }
+  free(a->marks);
+  free(a->journal);
+  *a = (arena){0};
+}
+
+void acheckpoint(arena *a) {
+  if (a->nmarks == a->markcap) {
+    a->markcap = a->markcap ? a->markcap << 1 : 4;
+    a->marks = realloc(a->marks, a->markcap * sizeof(amark));
+  }
+  a->marks[a->nmarks++] = (amark){a->cur, a->used, a->inuse, a->jlen};
+}
+
+// Note the n bytes at p, which are about to be overwritten, if there
+// is a checkpoint to go back to
+void ajournal(arena *a, void *p, size_t n) {
+  size_t pad;
+
+  if (!a->nmarks) return;
+  pad = (n + JALIGN - 1) & ~(JALIGN - 1);
+  if (a->jlen + pad + 2 * sizeof(size_t) > a->jcap) {
+    a->jcap = a->jcap ? a->jcap << 1 : ARENACHUNK;
+    while (a->jlen + pad + 2 * sizeof(size_t) > a->jcap) a->jcap <<= 1;
+    a->journal = realloc(a->journal, a->jcap);
+  }
+  memcpy(a->journal + a->jlen, p, n);
+  a->jlen += pad;
+  memcpy(a->journal + a->jlen, &p, sizeof(size_t));
+  memcpy(a->journal + a->jlen + sizeof(size_t), &n, sizeof(size_t));
+  a->jlen += 2 * sizeof(size_t);
+}
+
+// Go back to the innermost checkpoint, and drop it. Returns false if
+// there is none.
+bool arollback(arena *a) {
+  amark *m;
+  void *p;
+  size_t n;
+
+  if (!a->nmarks) return false;
+  m = &a->marks[--a->nmarks];
+  while (a->jlen > m->jlen) {
+    a->jlen -= 2 * sizeof(size_t);
+    memcpy(&p, a->journal + a->jlen, sizeof(size_t));
+    memcpy(&n, a->journal + a->jlen + sizeof(size_t), sizeof(size_t));
+    a->jlen -= (n + JALIGN - 1) & ~(JALIGN - 1);
+    memcpy(p, a->journal + a->jlen, n);
+  }
+  // Nothing had been allocated yet if cur was NULL
+  a->cur = m->cur ? m->cur : a->first;
+  a->used = m->cur ? m->used : 0;
+  a->inuse = m->inuse;
+  return true;
+}
+
+// Drop the innermost checkpoint, keeping everything done since. What
+// the journal holds stays for the next checkpoint out, if any. Returns
+// false if there is none.
+bool acommit(arena *a) {
+  if (!a->nmarks) return false;
+  a->nmarks--;
+  if (!a->nmarks) a->jlen = 0;
+  return true;
+}
+#endif
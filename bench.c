@@ -0,0 +1,325 @@
+// Resolution benchmark
+//
+// Generates synthetic universes and drives types.c directly, bypassing
+// the parser:
+//   deep       a single inheritance chain, with overrides spread along it
+//   wide       many direct subtypes of one type, each overriding a method
+//   overloads  one type with many unrelated overloads of one name
+//   flat       many unrelated types, each declaring a method of its own,
+//              after which the size of the dispatch tables is checked
+//   objects    many objects with mixed ctt/rtt, dispatched in turn, and
+//              then 64 at a time, one by one and in bulk (see
+//              batchresolve(), dispatchobjects()), with every ctt
+//              different, a few interleaved, and a single one
+//
+// Build with `gcc -O2 bench.c -o bench` and run `./bench [scale]`,
+// where scale (default 1) multiplies the size of every universe. For
+// each operation it reports calls/sec and ns/call percentiles; calls
+// are timed in batches of BATCH, so that the clock itself is not what
+// is being measured.
+#include <time.h>
+#include "types.c"
+
+#define BATCH   64
+#define SAMPLES 2000
+#define BULK    64      // Objects per call to the bulk operations
+#define MIXED   16      // Distinct ctts among the objects of a mixed call
+
+universe *U;     // The universe being measured
+double samples[SAMPLES];
+char namebuf[64];
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static symbol name(char *prefix, size_t i) {
+  snprintf(namebuf, sizeof(namebuf), "%s%zu", prefix, i);
+  return intern(&U->syms, namebuf);
+}
+
+static int cmpdouble(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(char *scenario, char *op, double total, size_t calls) {
+  qsort(samples, SAMPLES, sizeof(double), cmpdouble);
+  printf("%-10s %-12s %12.0f %8.1f %8.1f %8.1f\n", scenario, op,
+         calls / total * 1e9,
+         samples[SAMPLES / 2], samples[SAMPLES * 9 / 10], samples[SAMPLES * 99 / 100]);
+}
+
+// Each operation is a macro rather than a function pointer, so that
+// the call being measured is not hidden behind an indirect call. BODY
+// is run once per call with the call number in i.
+#define MEASURE(scenario, op, BODY) do {                        \
+    size_t s, k, i;                                             \
+    double t0, t1, total;                                       \
+    total = 0;                                                  \
+    for (i = 0, s = 0; s < SAMPLES; s++) {                      \
+      t0 = now();                                               \
+      for (k = 0; k < BATCH; k++, i++) { BODY; }                \
+      t1 = now();                                               \
+      samples[s] = (t1 - t0) / BATCH;                           \
+      total += t1 - t0;                                         \
+    }                                                           \
+    report(scenario, op, total, (size_t)SAMPLES * BATCH);       \
+  } while (0)
+
+// Types and objects of the universe being measured
+type **types;
+size_t ntypes;
+object *objects;
+symbol *objnames;
+size_t nobjects;
+signature **sigs;
+size_t nsigs;
+volatile size_t sink;
+method *bestmeths[SAMPLES * BATCH];   // The compile-time result of each call
+
+static void reset(size_t maxtypes, size_t maxobjects) {
+  resetuniverse(U);
+  free(types);
+  free(objects);
+  free(objnames);
+  free(sigs);
+  types = malloc(maxtypes * sizeof(type *));
+  objects = malloc(maxobjects * sizeof(object));
+  objnames = malloc(maxobjects * sizeof(symbol));
+  sigs = malloc(maxtypes * sizeof(signature *));
+  ntypes = nobjects = nsigs = 0;
+}
+
+static type *addtype(symbol super) {
+  symbol s;
+  s = name("T", ntypes);
+  creattype(U, s, super);
+  return types[ntypes++] = gettype(U, s);
+}
+
+static signature *sig1(type *t) {
+  type *ts[2];
+  ts[0] = t;
+  ts[1] = NULL;
+  return internsig(U, ts);
+}
+
+static void addobject(type *ctt, type *rtt) {
+  symbol s;
+  s = name("o", nobjects);
+  creatobject(U, s, ctt, rtt);
+  getobject(U, s, &objects[nobjects]);
+  objnames[nobjects++] = s;
+}
+
+// Run the operations common to every scenario: calls are made on the
+// objects in turn, each with the argument signature of the same index.
+static void run(char *scenario) {
+  symbol f;
+  method *bestmeth, *meth;
+  uint64_t rnd;
+  size_t i;
+
+  f = intern(&U->syms, "f");
+  rnd = 88172645463325252ULL;
+
+#define NEXT (rnd ^= rnd << 13, rnd ^= rnd >> 7, rnd ^= rnd << 17)
+  MEASURE(scenario, "issubtype", {
+      type *s = types[NEXT % ntypes];
+      sink += issubtype(U, s, types[NEXT % ntypes]);
+    });
+  MEASURE(scenario, "htfind", sink += (size_t)htfind(&U->types, symkey(&U->syms, types[i % ntypes]->sym)));
+  // The first pass over the calls fills the resolution cache, and the
+  // second only hits it
+  MEASURE(scenario, "ctt cold", {
+      object *o = &objects[i % nobjects];
+      sink += cttresolve(U, f, o->ctt, sigs[i % nsigs], &bestmeth);
+    });
+  MEASURE(scenario, "cttresolve", {
+      object *o = &objects[i % nobjects];
+      sink += cttresolve(U, f, o->ctt, sigs[i % nsigs], &bestmeth);
+    });
+  MEASURE(scenario, "_cttresolve", {
+      object *o = &objects[i % nobjects];
+      sink += _cttresolve(U, f, o->ctt, sigs[i % nsigs], &bestmeth);
+    });
+  // The compile-time step of each call is done up front, so that only
+  // the runtime step is timed
+  for (i = 0; i < SAMPLES * BATCH; i++)
+    if (!cttresolve(U, f, objects[i % nobjects].ctt, sigs[i % nsigs], &bestmeths[i])) bestmeths[i] = NULL;
+  MEASURE(scenario, "rttresolve", {
+      if (bestmeths[i]) sink += rttresolve(U, bestmeths[i], objects[i % nobjects].rtt, &meth);
+    });
+#undef NEXT
+}
+
+// A chain T0 <: T1 <: ... of depth n, with f(Object) overridden at
+// every eighth level and called on objects spread along the chain.
+static void deep(size_t n) {
+  size_t i;
+  symbol f, super;
+  signature *sig;
+
+  reset(n, n);
+  f = intern(&U->syms, "f");
+  super = intern(&U->syms, "Object");
+  for (i = 0; i < n; i++) super = addtype(super)->sym;
+  sig = sig1(gettype(U, intern(&U->syms, "Object")));
+  for (i = 0; i < n; i += 8) creatmethod(U, f, types[i], sig, NULL);
+
+  for (i = 0; i < n; i++) addobject(types[i], types[n - 1]);
+  sigs[nsigs++] = sig1(types[n - 1]);
+  run("deep");
+}
+
+// n direct subtypes of Base, each overriding f(Base)
+static void wide(size_t n) {
+  size_t i;
+  symbol f, base;
+  type *b;
+  signature *sig;
+
+  reset(n + 1, n);
+  f = intern(&U->syms, "f");
+  base = intern(&U->syms, "Base");
+  creattype(U, base, intern(&U->syms, "Object"));
+  b = gettype(U, base);
+  sig = sig1(b);
+  creatmethod(U, f, b, sig, NULL);
+  for (i = 0; i < n; i++) creatmethod(U, f, addtype(base), sig, NULL);
+
+  for (i = 0; i < n; i++) addobject(b, types[i]);
+  for (i = 0; i < n; i++) sigs[nsigs++] = sig1(types[i]);
+  run("wide");
+}
+
+// n unrelated types, and a type Api overloading f once for each
+static void overloads(size_t n) {
+  size_t i;
+  symbol f, api, object;
+  type *a;
+
+  reset(n, 1);
+  f = intern(&U->syms, "f");
+  api = intern(&U->syms, "Api");
+  object = intern(&U->syms, "Object");
+  creattype(U, api, object);
+  a = gettype(U, api);
+  for (i = 0; i < n; i++) creatmethod(U, f, a, sig1(addtype(object)), NULL);
+
+  addobject(a, a);
+  for (i = 0; i < n; i++) sigs[nsigs++] = sig1(types[i]);
+  run("overloads");
+}
+
+// n direct subtypes of Object, each declaring f(Object) of its own.
+// None of them overrides another's, so they all take the same slot, and
+// the dispatch tables built along the way must have one slot each
+// rather than one per method in the universe. Returns whether they do.
+static bool flat(size_t n) {
+  size_t i, nslots, ntables;
+  symbol f, object;
+  signature *sig;
+
+  reset(n, n);
+  f = intern(&U->syms, "f");
+  object = intern(&U->syms, "Object");
+  sig = sig1(gettype(U, object));
+  for (i = 0; i < n; i++) creatmethod(U, f, addtype(object), sig, NULL);
+
+  for (i = 0; i < n; i++) addobject(types[i], types[i]);
+  sigs[nsigs++] = sig;
+  run("flat");
+
+  nslots = ntables = 0;
+  for (i = 0; i < n; i++) {
+    if (!types[i]->dispatch) continue;
+    nslots += types[i]->ndispatch;
+    ntables++;
+  }
+  printf("%-10s %-12s %12zu slots in %zu tables\n", "flat", "dispatch", nslots, ntables);
+  return ntables == n && nslots == n;
+}
+
+// A tree of n types with fan-out 4, f(Object) overridden on every
+// third type, and objects whose ctt is the parent of their rtt
+static void objects_(size_t n, size_t m) {
+  size_t i;
+  symbol f;
+  signature *sig;
+  type *t;
+  method *bestmeth, *meths[BULK];
+  object o;
+  size_t j;
+  int pass;
+
+  reset(n, m);
+  f = intern(&U->syms, "f");
+  addtype(intern(&U->syms, "Object"));
+  for (i = 1; i < n; i++) addtype(types[(i - 1) / 4]->sym);
+  sig = sig1(gettype(U, intern(&U->syms, "Object")));
+  creatmethod(U, f, types[0], sig, NULL);
+  for (i = 3; i < n; i += 3) creatmethod(U, f, types[i], sig, NULL);
+
+  for (i = 0; i < m; i++) {
+    t = types[1 + (i * 7919) % (n - 1)];
+    addobject(t->super, t);
+  }
+  for (i = 0; i < n; i++) sigs[nsigs++] = sig1(types[i]);
+  run("objects");
+
+  // The same calls made for BULK objects at a time in order of name,
+  // one by one and then in bulk; times are per BULK objects. The ctts
+  // of the objects are first all different, then MIXED types taken in
+  // turn (each with a few rtts below it), then all the same.
+  for (pass = 0; pass < 3; pass++) {
+    if (pass == 1)
+      for (i = 0; i < m; i++) {
+        objnames[i] = name("p", i);
+        j = 1 + i % MIXED;
+        creatobject(U, objnames[i], types[j], types[4 * j + 1 + i / MIXED % 4]);
+      }
+    if (pass == 2)
+      for (i = 0; i < m; i++) {
+        objnames[i] = name("q", i);
+        creatobject(U, objnames[i], types[0], types[1 + (i * 7919) % (n - 1)]);
+      }
+    MEASURE("objects", pass == 2 ? "each/1ctt" : pass ? "each/mixed" : "each", {
+        symbol *ns = objnames + i * BULK % (m - BULK);
+        for (j = 0; j < BULK; j++) {
+          getobject(U, ns[j], &o);
+          if (cttresolve(U, f, o.ctt, sigs[0], &bestmeth))
+            sink += rttresolve(U, bestmeth, o.rtt, &meths[0]);
+        }
+      });
+    MEASURE("objects", pass == 2 ? "batch/1ctt" : pass ? "batch/mixed" : "batch", {
+        sink += batchresolve(U, f, sigs[0], objnames + i * BULK % (m - BULK), BULK, meths);
+      });
+  }
+  cttresolve(U, f, types[0], sig, &bestmeth);
+  MEASURE("objects", "bulk rtt", {
+      sink += dispatchobjects(U, bestmeth, objnames + i * BULK % (m - BULK), BULK, meths);
+    });
+}
+
+int main(int argc, char **argv) {
+  size_t scale;
+
+  scale = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+  if (!scale) scale = 1;
+  U = newuniverse();
+
+  printf("%-10s %-12s %12s %8s %8s %8s\n", "scenario", "op", "calls/sec", "p50 ns", "p90 ns", "p99 ns");
+  deep(60 * scale);
+  wide(1000 * scale);
+  overloads(500 * scale);
+  if (!flat(20000 * scale)) {
+    fprintf(stderr, "flat: dispatch tables are wider than their types need\n");
+    return 1;
+  }
+  objects_(10000 * scale, 100000 * scale);
+  return 0;
+}
@@ -0,0 +1,95 @@
+// Microbenchmark for hashtable.c
+//
+// Build once per layout and compare:
+//   gcc -O2 bench_hashtable.c -o bench_linear
+//   gcc -O2 -DHT_SWISS bench_hashtable.c -o bench_swiss
+//
+// Usage: ./bench_linear [maxkeys], where maxkeys defaults to 10^7.
+// For each table size 10^3, 10^4, ... up to maxkeys, reports ns per
+// insert, per successful lookup and per failed lookup, and then how
+// long htfreeze() takes and the lookups again on the frozen table.
+#include <time.h>
+#include "hashtable.c"
+
+#define KEYLEN 32
+
+hashtable ht;
+char *keys;
+char *misses;
+size_t *order;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keys look like generated class names (Node0, Node1, ...), the case
+// that the old byte-sum hash handled worst.
+static void makekeys(size_t n) {
+  size_t i, j, t;
+
+  keys = malloc(n * KEYLEN);
+  misses = malloc(n * KEYLEN);
+  order = malloc(n * sizeof(size_t));
+  for (i = 0; i < n; i++) {
+    snprintf(keys + i*KEYLEN, KEYLEN, "Node%zu", i);
+    snprintf(misses + i*KEYLEN, KEYLEN, "Leaf%zu", i);
+    order[i] = i;
+  }
+
+  // Look keys up in a shuffled order so that probes don't follow
+  // insertion order
+  srand(1);
+  for (i = n - 1; i > 0; i--) {
+    j = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+    t = order[i]; order[i] = order[j]; order[j] = t;
+  }
+}
+
+static void run(size_t n) {
+  size_t i, found;
+  double t0, t1, t2, t3, t4, t5, t6;
+
+  makekeys(n);
+  htinit(&ht, 1);
+
+  t0 = now();
+  for (i = 0; i < n; i++) htinsert(&ht, keys + i*KEYLEN, keys + i*KEYLEN);
+  t1 = now();
+  for (found = 0, i = 0; i < n; i++) found += htfind(&ht, keys + order[i]*KEYLEN) != NULL;
+  t2 = now();
+  for (i = 0; i < n; i++) found += htfind(&ht, misses + order[i]*KEYLEN) != NULL;
+  t3 = now();
+  assert(found == n);
+
+  htfreeze(&ht);
+  t4 = now();
+  for (found = 0, i = 0; i < n; i++) found += htfind(&ht, keys + order[i]*KEYLEN) != NULL;
+  t5 = now();
+  for (i = 0; i < n; i++) found += htfind(&ht, misses + order[i]*KEYLEN) != NULL;
+  t6 = now();
+  assert(found == n);
+
+  printf("%10zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", n, (t1-t0) / n, (t2-t1) / n, (t3-t2) / n,
+         (t4-t3) / n, (t5-t4) / n, (t6-t5) / n);
+
+  htfree(&ht);
+  free(keys);
+  free(misses);
+  free(order);
+}
+
+int main(int argc, char **argv) {
+  size_t n, maxkeys;
+
+  maxkeys = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+#ifdef HT_SWISS
+  printf("layout: swiss\n");
+#else
+  printf("layout: linear\n");
+#endif
+  printf("%10s %10s %10s %10s %10s %10s %10s\n", "keys", "insert", "hit", "miss", "freeze", "mph hit", "mph miss");
+  for (n = 1000; n <= maxkeys; n *= 10) run(n);
+  return 0;
+}
@@ -9,5 +9,4 @@
 #include <stdio.h>
 
 typedef enum {false, true} bool;
-char *errmsg;
 #endif
\ No newline at end of file
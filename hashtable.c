@@ -1,12 +1,49 @@
 // Home-grown hashtable implementation
 // Uses open addressing and linear probing.
 //
-// My choice of hash function (summing up bytes) and linear probing
-// offset (1) is quite shitty, but it works for simple use cases.
+// Keys are hashed with 64-bit FNV-1a, and the full hash is kept in
+// each entry so that growing doesn't rehash keys and probing only
+// compares keys whose hashes match. The capacity is always a power of
+// two.
+//
+// Building with -DHT_SWISS switches every table to a Swiss-table
+// layout: a separate array of control bytes holds a 7-bit tag from
+// each occupied slot's hash (or CTRLEMPTY), and probing compares 16
+// control bytes at a time with SSE2, only touching the entries whose
+// tags match. The entries array and its `occupied` flags are kept in
+// both layouts, so code that iterates over a table works unchanged.
+//
+// A table made with htinitmem() takes its storage from an arena
+// instead of the heap. Changes to such a table are noted in the
+// arena's journal (see ajournal()), so an arena rollback undoes them;
+// the table header itself is journaled too, wherever it lives.
+//
+// htremove() takes an item out. In the default layout the items after
+// it in its run are shifted back over the hole, so that lookups never
+// probe further than if it had never been there. The Swiss layout
+// leaves a tombstone instead, unless the slot's group has an empty
+// slot (in which case no probe sequence can run through the group);
+// tombstones count towards the load and are cleared out by rehashing.
+// A table shrinks once it is at most 1/8 full. One in an arena is
+// rehashed into new storage from the arena, as when it grows, and the
+// old storage is only taken back when the arena is reset. Since it has
+// to be at least half full again to grow, and then 1/8 full to shrink,
+// each round of growing and shrinking again takes a number of
+// insertions and removals in proportion to the storage it leaves.
+//
+// A table whose keys won't change any more can be frozen with
+// htfreeze(), which adds a minimal perfect hash over its keys; see
+// there. The probed layout stays in place underneath, and the first
+// insertion afterwards simply drops the perfect hash again.
 #include "common.h"
+#include "arena.c"
+#if defined(HT_SWISS) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef struct {
   bool occupied;
+  size_t hash;
   char *key;
   void *value;
 } hashtable_entry;
@@ -20,83 +57,301 @@ typedef struct {
                     // they may contain zero bytes without being NULL
                     // itself.
   hashtable_entry *entries;
+#ifdef HT_SWISS
+  unsigned char *ctrl;
+#endif
+  arena *mem;       // Where the storage comes from, or NULL for the heap
+  size_t deleted;   // Tombstones (only in the Swiss layout)
+
+  hashtable_entry *mph;   // The items entries placed by the perfect hash,
+  uint32_t *mphseed;      // and its seed for each bucket, or NULL if
+  size_t mphbuckets;      // the table isn't frozen
 } hashtable;
 
-static size_t _hthash(char *key, size_t keytype, size_t capacity) {
-  int sum;
+#ifdef HT_SWISS
+#define GROUPSIZE 16
+#define CTRLEMPTY 0x80
+#define CTRLDELETED 0xfe
+#define HTINIT    GROUPSIZE
+#define TAG(hash)   ((unsigned char)((hash) & 0x7f))
+#define GROUP(hash) ((hash) >> 7)
+
+// Bitmask of the slots in the group at ctrl whose control byte is c
+static unsigned _groupmatch(unsigned char *ctrl, unsigned char c) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)ctrl), _mm_set1_epi8(c)));
+#else
+  unsigned m;
   int i;
+  for (m = 0, i = 0; i < GROUPSIZE; i++)
+    if (ctrl[i] == c) m |= 1u << i;
+  return m;
+#endif
+}
+
+// Bitmask of the slots in the group at ctrl that are empty or deleted,
+// which are the ones with the top bit set
+static unsigned _groupfree(unsigned char *ctrl) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((__m128i *)ctrl));
+#else
+  unsigned m;
+  int i;
+  for (m = 0, i = 0; i < GROUPSIZE; i++)
+    if (ctrl[i] & 0x80) m |= 1u << i;
+  return m;
+#endif
+}
+#else
+#define HTINIT 8
+#endif
+
+#define FNVBASIS 14695981039346656037ULL
+#define FNVPRIME 1099511628211ULL
+
+static size_t _hthash(char *key, size_t keytype) {
+  uint64_t h;
+  size_t i;
   bool allnull;
   char *p;
 
-  sum = 0;
+  h = FNVBASIS;
   p = key;
 
 nextelem:
-  i = 0;
-
   allnull = true;
   for (i = 0; i < keytype; i++)
     if (p[i]) { allnull = false; break; }
-  if (allnull) return (size_t)sum % capacity;
+  if (allnull) return (size_t)h;
 
-  for (i = 0; i < keytype; p++, i++) sum += (int)*p;
+  for (i = 0; i < keytype; p++, i++) {
+    h ^= (unsigned char)*p;
+    h *= FNVPRIME;
+  }
   goto nextelem;
 }
 
-void htinit(hashtable *ht, size_t keytype) {
-  size_t init = 8;
+// Hash of the first len bytes of key; the same as _hthash() would give
+// for those bytes with keytype 1 and a terminating zero.
+static size_t _hthashn(char *key, size_t len) {
+  uint64_t h;
+  size_t i;
+
+  h = FNVBASIS;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= FNVPRIME;
+  }
+  return (size_t)h;
+}
+
+static void *_htalloc(hashtable *ht, size_t n) {
+  return ht->mem ? aalloc(ht->mem, n) : calloc(1, n);
+}
+
+void htinitmem(hashtable *ht, size_t keytype, arena *mem) {
   ht->items = 0;
-  ht->capacity = init;
+  ht->capacity = HTINIT;
   ht->keytype = keytype;
-  ht->entries = calloc(init, sizeof(hashtable_entry));
+  ht->mem = mem;
+  ht->deleted = 0;
+  ht->mph = NULL;
+  ht->mphseed = NULL;
+  ht->entries = _htalloc(ht, HTINIT * sizeof(hashtable_entry));
+#ifdef HT_SWISS
+  ht->ctrl = _htalloc(ht, HTINIT);
+  memset(ht->ctrl, CTRLEMPTY, HTINIT);
+#endif
+}
+
+void htinit(hashtable *ht, size_t keytype) {
+  htinitmem(ht, keytype, NULL);
+}
+
+// Release the table's storage; the keys and values are not touched.
+// Storage from an arena is only reclaimed when the arena is reset.
+void htfree(hashtable *ht) {
+  if (ht->mem) return;
+  free(ht->entries);
+  free(ht->mph);
+  free(ht->mphseed);
+  ht->mph = NULL;
+  ht->mphseed = NULL;
+#ifdef HT_SWISS
+  free(ht->ctrl);
+#endif
 }
 
-static void _insert(hashtable_entry *entries, char *key, void *value, size_t keytype, size_t capacity) {
+#ifdef HT_SWISS
+// Place into the first empty or deleted slot along the key's probe
+// sequence, which visits whole groups in turn. Returns whether it was
+// a deleted one.
+// Slots about to be written are noted in journal, unless that is NULL.
+static bool _insert(arena *journal, hashtable_entry *entries, unsigned char *ctrl, size_t hash, char *key, void *value, size_t capacity) {
+  size_t g, ngroups;
+  unsigned m;
+  hashtable_entry *e;
+  bool reused;
+
+  ngroups = capacity / GROUPSIZE;
+  g = GROUP(hash) & (ngroups - 1);
+try:
+  m = _groupfree(ctrl + g * GROUPSIZE);
+  if (!m) {
+    g = (g + 1) & (ngroups - 1);
+    goto try;
+  }
+  g = g * GROUPSIZE + __builtin_ctz(m);
+  e = entries + g;
+  if (journal) {
+    ajournal(journal, ctrl + g, 1);
+    ajournal(journal, e, sizeof *e);
+  }
+  reused = ctrl[g] == CTRLDELETED;
+  ctrl[g] = TAG(hash);
+#else
+// Slots about to be written are noted in journal, unless that is NULL.
+static bool _insert(arena *journal, hashtable_entry *entries, size_t hash, char *key, void *value, size_t capacity) {
   size_t h;
   hashtable_entry *e;
-  h = _hthash(key, keytype, capacity);
+  bool reused;
+  h = hash & (capacity - 1);
 try:
   e = entries + h;
   if (e->occupied) {
     // Linear probe
-    h++;
-    if (h >= capacity) h -= capacity;
+    h = (h + 1) & (capacity - 1);
     goto try;
   }
+  if (journal) ajournal(journal, e, sizeof *e);
+  reused = false;
+#endif
   e->occupied = true;
+  e->hash = hash;
   e->key = key;
   e->value = value;
+  return reused;
 }
 
-void htinsert(hashtable *ht, char *key, void *value) {
-  hashtable_entry *e, *e1;
+#ifdef HT_SWISS
+// Whether a table holding items needs to grow before taking one more.
+// Swiss tables stay fast up to a load factor of 7/8.
+#define _NEEDGROW(items, capacity) ((((items) + 1) << 3) > (capacity) * 7)
+#else
+#define _NEEDGROW(items, capacity) (((items) << 1) >= (capacity))
+#endif
+// Whether a table holding items could be half the size
+#define _NEEDSHRINK(items, capacity) ((capacity) > HTINIT && ((items) << 3) <= (capacity))
 
-  // Grow hashtable if necessary
-  if ((ht->items << 1) >= ht->capacity) {
-    e1 = calloc(ht->capacity << 1, sizeof(hashtable_entry));
+// Rehash ht into capacity slots. A table in an arena that keeps its
+// capacity, as when clearing out tombstones, is rehashed in place, so
+// that doing so over and over doesn't eat the arena.
 
-    // Rehash everything
-    for (e = ht->entries; e < ht->entries + ht->capacity; e++) {
-      if (!e->occupied) continue;
-      _insert(e1, e->key, e->value, ht->keytype, ht->capacity << 1);
-    }
+static void _htresize(hashtable *ht, size_t capacity) {
+  hashtable_entry *e, *old, *e1;
+#ifdef HT_SWISS
+  unsigned char *c1;
+#endif
+  bool inplace;
+
+  inplace = ht->mem && capacity == ht->capacity;
+  old = ht->entries;
+  if (inplace) {
+    old = malloc(capacity * sizeof(hashtable_entry));
+    memcpy(old, ht->entries, capacity * sizeof(hashtable_entry));
+    ajournal(ht->mem, ht->entries, capacity * sizeof(hashtable_entry));
+    e1 = ht->entries;
+    memset(e1, 0, capacity * sizeof(hashtable_entry));
+  }
+  else e1 = _htalloc(ht, capacity * sizeof(hashtable_entry));
+#ifdef HT_SWISS
+  if (inplace) {
+    ajournal(ht->mem, ht->ctrl, capacity);
+    c1 = ht->ctrl;
+  }
+  else c1 = _htalloc(ht, capacity);
+  memset(c1, CTRLEMPTY, capacity);
+#endif
 
-    e = ht->entries;
-    ht->entries = e1;
-    ht->capacity <<= 1;
-    free(e);
+  // Rehash everything
+  for (e = old; e < old + ht->capacity; e++) {
+    if (!e->occupied) continue;
+#ifdef HT_SWISS
+    _insert(NULL, e1, c1, e->hash, e->key, e->value, capacity);
+#else
+    _insert(NULL, e1, e->hash, e->key, e->value, capacity);
+#endif
   }
 
-  _insert(ht->entries, key, value, ht->keytype, ht->capacity);
+  if (inplace) free(old);
+  else htfree(ht);
+  ht->entries = e1;
+#ifdef HT_SWISS
+  ht->ctrl = c1;
+#endif
+  ht->capacity = capacity;
+  ht->deleted = 0;
+}
+
+static void _htthaw(hashtable *ht) {
+  if (!ht->mem) { free(ht->mph); free(ht->mphseed); }
+  ht->mph = NULL;
+  ht->mphseed = NULL;
+}
+
+void htinsert(hashtable *ht, char *key, void *value) {
+  bool reused;
+
+  if (ht->mem) ajournal(ht->mem, ht, sizeof *ht);
+  if (ht->mph) _htthaw(ht);
+  // Tombstones take up room too, but clearing them out may be enough
+  if (_NEEDGROW(ht->items + ht->deleted, ht->capacity))
+    _htresize(ht, _NEEDGROW(ht->items, ht->capacity) ? ht->capacity << 1 : ht->capacity);
+#ifdef HT_SWISS
+  reused = _insert(ht->mem, ht->entries, ht->ctrl, _hthash(key, ht->keytype), key, value, ht->capacity);
+#else
+  reused = _insert(ht->mem, ht->entries, _hthash(key, ht->keytype), key, value, ht->capacity);
+#endif
+  if (reused) ht->deleted--;
   ht->items++;
 }
 
+// Make room for n items in all, so that inserting them won't grow ht
+// on the way.
+void htreserve(hashtable *ht, size_t n) {
+  size_t capacity;
+
+  if (ht->mem) ajournal(ht->mem, ht, sizeof *ht);
+  if (ht->mph) _htthaw(ht);
+  for (capacity = ht->capacity; n && _NEEDGROW(n - 1 + ht->deleted, capacity); capacity <<= 1);
+  if (capacity != ht->capacity) _htresize(ht, capacity);
+}
+
+// Where to start going through ht's slots (wrapping around at the end)
+// so that inserting its items in that order into an empty table of the
+// same capacity puts every item back into the slot it is in now. That
+// is the start of a group following one with an empty slot, since no
+// probe sequence runs through such a group. (Not quite when the table
+// has tombstones, whose slots the items would then fill in.)
+size_t htorigin(hashtable *ht) {
+  size_t i, j, g;
+#ifdef HT_SWISS
+  g = GROUPSIZE;
+#else
+  g = 1;
+#endif
+  for (i = ht->capacity; i > 0; i -= g)
+    for (j = i - g; j < i; j++)
+      if (!ht->entries[j].occupied) return i & (ht->capacity - 1);
+  return 0;
+}
+
 // Return 0 if key1 = key2 as arrays of `keytype`-byte sized elements,
 //        1 otherwise.
 
 static int comparekey(char *key1, char *key2, size_t keytype) {
   bool allnull1, allnull2;
-  int i;
+  size_t i;
   char *p1, *p2;
 
   p1 = key1;
@@ -118,24 +373,261 @@ nextelem:
   goto nextelem;
 }
 
-void *htfind(hashtable *ht, char *key) {
-  size_t h, h1;
+// Whether e holds key, which has the given hash. If len is not NOLEN,
+// key is a string of len bytes that need not be zero-terminated.
+
+#define NOLEN ((size_t)-1)
+static bool _matches(hashtable *ht, hashtable_entry *e, size_t hash, char *key, size_t len) {
+  if (e->hash != hash) return false;
+  if (len == NOLEN) return comparekey(e->key, key, ht->keytype) == 0;
+  return strncmp(e->key, key, len) == 0 && !e->key[len];
+}
+
+// The entry holding key, or NULL
+#ifdef HT_SWISS
+static hashtable_entry *_htentry(hashtable *ht, size_t hash, char *key, size_t len) {
+  size_t g, ngroups;
+  unsigned m;
+  unsigned char *ctrl;
+  hashtable_entry *e;
+
+  ngroups = ht->capacity / GROUPSIZE;
+  g = GROUP(hash) & (ngroups - 1);
+try:
+  ctrl = ht->ctrl + g * GROUPSIZE;
+  for (m = _groupmatch(ctrl, TAG(hash)); m; m &= m - 1) {
+    e = ht->entries + g * GROUPSIZE + __builtin_ctz(m);
+    if (_matches(ht, e, hash, key, len)) return e;
+  }
+  // An empty slot ends the probe sequence
+  if (_groupmatch(ctrl, CTRLEMPTY)) return NULL;
+  g = (g + 1) & (ngroups - 1);
+  goto try;
+}
+#else
+static hashtable_entry *_htentry(hashtable *ht, size_t hash, char *key, size_t len) {
+  size_t h;
   hashtable_entry *e;
 
-  h = _hthash(key, ht->keytype, ht->capacity);
+  h = hash & (ht->capacity - 1);
 try:
   e = ht->entries + h;
   if (!e->occupied) return NULL;
-  if (comparekey(e->key, key, ht->keytype) == 0) return e->value;
-  h++;
-  if (h >= ht->capacity) h -= ht->capacity;
+  if (_matches(ht, e, hash, key, len)) return e;
+  h = (h + 1) & (ht->capacity - 1);
   goto try;
 }
+#endif
+
+static void *_htfind(hashtable *ht, size_t hash, char *key, size_t len) {
+  hashtable_entry *e;
+  e = _htentry(ht, hash, key, len);
+  return e ? e->value : NULL;
+}
+
+// Take key out of ht, returning its value, or NULL if it wasn't there
+void *htremove(hashtable *ht, char *key) {
+  hashtable_entry *e;
+  void *value;
+  size_t i, capacity;
+#ifndef HT_SWISS
+  size_t j, home, mask;
+#endif
+
+  if (ht->mem) ajournal(ht->mem, ht, sizeof *ht);
+  if (ht->mph) _htthaw(ht);
+  e = _htentry(ht, _hthash(key, ht->keytype), key, NOLEN);
+  if (!e) return NULL;
+  value = e->value;
+  i = e - ht->entries;
+
+#ifdef HT_SWISS
+  if (ht->mem) ajournal(ht->mem, ht->ctrl + i, 1);
+  if (_groupmatch(ht->ctrl + (i & ~(size_t)(GROUPSIZE - 1)), CTRLEMPTY)) ht->ctrl[i] = CTRLEMPTY;
+  else {
+    ht->ctrl[i] = CTRLDELETED;
+    ht->deleted++;
+  }
+#else
+  // Shift back each item of the run after the hole that may move into
+  // it, i.e. whose home slot isn't cyclically within (i, j]
+  mask = ht->capacity - 1;
+  for (j = (i + 1) & mask; ht->entries[j].occupied; j = (j + 1) & mask) {
+    home = ht->entries[j].hash & mask;
+    if (i <= j ? i < home && home <= j : i < home || home <= j) continue;
+    if (ht->mem) ajournal(ht->mem, ht->entries + i, sizeof(hashtable_entry));
+    ht->entries[i] = ht->entries[j];
+    i = j;
+  }
+#endif
+  if (ht->mem) ajournal(ht->mem, ht->entries + i, sizeof(hashtable_entry));
+  ht->entries[i] = (hashtable_entry){0};
+  ht->items--;
+
+  if (_NEEDSHRINK(ht->items, ht->capacity)) {
+    for (capacity = ht->capacity; _NEEDSHRINK(ht->items, capacity); capacity >>= 1);
+    _htresize(ht, capacity);
+  }
+  return value;
+}
+
+// Minimal perfect hashing, by hash and displace (as in CHD)
+//
+// The items of a frozen table are split into buckets of about MPHLAMBDA
+// keys each by their hash. Every bucket has a seed,
+// chosen so that mixing it into the hash sends the bucket's keys to
+// slots not taken by any other key. A lookup thus computes one slot
+// and compares one key, and the slots array has no holes.
+//
+// The buckets are placed largest first. By the time the buckets of a
+// single key come up most slots are taken, and finding a seed that
+// hits a free one would take long, so such a bucket's seed is instead
+// the free slot itself, marked with MPHDIRECT.
+
+#define MPHLAMBDA   3
+#define MPHMAXSEED  (1u << 20)
+#define MPHDIRECT   (1u << 31)
+
+static size_t _mphbucket(hashtable *ht, size_t hash) {
+  return (((uint64_t)hash * 0xc2b2ae3d27d4eb4fULL) >> 32) * ht->mphbuckets >> 32;
+}
+
+static size_t _mphslot(size_t hash, uint32_t seed, size_t n) {
+  uint64_t h;
+  h = (uint64_t)hash ^ (seed * 0x9e3779b97f4a7c15ULL);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return ((h & 0xffffffff) * n) >> 32;
+}
+
+// Freeze ht, returning false if no perfect hash could be found (which
+// leaves the table as it was, and no slower).
+
+bool htfreeze(hashtable *ht) {
+  hashtable_entry *e, **sorted, *mph;
+  size_t n, nb, maxc, i, j, k, k1, b;
+  size_t *count, *first, *bysize, *order, *slots;
+  uint32_t *seed, sd;
+  unsigned char *taken;
+  bool ok;
+
+  n = ht->items;
+  if (ht->mph) return true;
+  if (!n || n >= MPHDIRECT) return false;
+  if (ht->mem) ajournal(ht->mem, ht, sizeof *ht);
+  nb = ht->mphbuckets = n / MPHLAMBDA + 1;
+
+  // Sort the items by bucket
+  count = calloc(nb, sizeof(size_t));
+  first = malloc(nb * sizeof(size_t));    // Start of each bucket in sorted
+  sorted = malloc(n * sizeof(hashtable_entry *));
+  for (e = ht->entries; e < ht->entries + ht->capacity; e++)
+    if (e->occupied) count[_mphbucket(ht, e->hash)]++;
+  for (b = 0, j = 0; b < nb; b++) { first[b] = j; j += count[b]; }
+  for (e = ht->entries; e < ht->entries + ht->capacity; e++)
+    if (e->occupied) sorted[first[_mphbucket(ht, e->hash)]++] = e;
+  for (b = 0, maxc = 0; b < nb; b++) {
+    first[b] -= count[b];
+    if (count[b] > maxc) maxc = count[b];
+  }
+
+  // and the buckets by size, largest first, since those are the
+  // hardest to place
+  bysize = calloc(maxc + 1, sizeof(size_t));
+  order = malloc(nb * sizeof(size_t));
+  for (b = 0; b < nb; b++) bysize[count[b]]++;
+  for (i = maxc + 1, j = 0; i-- > 0;) { k = bysize[i]; bysize[i] = j; j += k; }
+  for (b = 0; b < nb; b++) order[bysize[count[b]]++] = b;
+
+  seed = _htalloc(ht, nb * sizeof(uint32_t));
+  taken = calloc(n, 1);
+  slots = malloc((maxc + 1) * sizeof(size_t));
+  ok = true;
+  for (i = 0; i < nb && count[order[i]] > 1; i++) {
+    b = order[i];
+    for (sd = 0; sd < MPHMAXSEED; sd++) {
+      for (k = 0; k < count[b]; k++) {
+        slots[k] = _mphslot(sorted[first[b] + k]->hash, sd, n);
+        if (taken[slots[k]]) break;
+        for (k1 = 0; k1 < k && slots[k1] != slots[k]; k1++);
+        if (k1 < k) break;
+      }
+      if (k == count[b]) break;
+    }
+    if (sd == MPHMAXSEED) { ok = false; break; }
+    for (k = 0; k < count[b]; k++) taken[slots[k]] = 1;
+    seed[b] = sd;
+  }
+  for (j = 0; ok && i < nb && count[order[i]]; i++) {
+    for (; taken[j]; j++);
+    taken[j] = 1;
+    seed[order[i]] = MPHDIRECT | j;
+  }
+
+  if (ok) {
+    mph = _htalloc(ht, n * sizeof(hashtable_entry));
+    for (k = 0; k < n; k++) {
+      e = sorted[k];
+      sd = seed[_mphbucket(ht, e->hash)];
+      mph[sd & MPHDIRECT ? sd & ~MPHDIRECT : _mphslot(e->hash, sd, n)] = *e;
+    }
+    ht->mph = mph;
+    ht->mphseed = seed;
+  }
+  else if (!ht->mem) free(seed);
+
+  free(count);
+  free(first);
+  free(sorted);
+  free(bysize);
+  free(order);
+  free(taken);
+  free(slots);
+  return ok;
+}
+
+static void *_mphfind(hashtable *ht, size_t hash, char *key, size_t len) {
+  hashtable_entry *e;
+  uint32_t sd;
+
+  sd = ht->mphseed[_mphbucket(ht, hash)];
+  e = ht->mph + (sd & MPHDIRECT ? sd & ~MPHDIRECT : _mphslot(hash, sd, ht->items));
+  return _matches(ht, e, hash, key, len) ? e->value : NULL;
+}
+
+void *htfind(hashtable *ht, char *key) {
+  size_t hash;
+  hash = _hthash(key, ht->keytype);
+  if (ht->mph) return _mphfind(ht, hash, key, NOLEN);
+  return _htfind(ht, hash, key, NOLEN);
+}
+
+// The hash that htfind() works out for key, in a table of the given
+// keytype. A key looked up in many such tables can be hashed once, and
+// then found in each with htfindhash().
+size_t hthash(char *key, size_t keytype) {
+  return _hthash(key, keytype);
+}
+
+void *htfindhash(hashtable *ht, char *key, size_t hash) {
+  if (ht->mph) return _mphfind(ht, hash, key, NOLEN);
+  return _htfind(ht, hash, key, NOLEN);
+}
+
+// Find a key given as a string of len bytes, without needing it to be
+// zero-terminated. Only for tables with keytype 1.
+void *htfindn(hashtable *ht, char *key, size_t len) {
+  size_t hash;
+  hash = _hthashn(key, len);
+  if (ht->mph) return _mphfind(ht, hash, key, len);
+  return _htfind(ht, hash, key, len);
+}
 
 void htdump(hashtable *ht) {
   hashtable_entry *e;
   size_t i;
   for (i = 0, e = ht->entries; i < ht->capacity; i++, e++)
     if (e->occupied)
-      printf("%zu: %s (hash=%zu)\n", i, e->key, _hthash(e->key, ht->keytype, ht->capacity));
+      printf("%zu: %s (hash=%zu)\n", i, e->key, e->hash & (ht->capacity - 1));
 }
\ No newline at end of file
@@ -1,107 +1,424 @@
 // The frontend
 //
 // Refer to types.c for a note about the term "signature/sig"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 #include "common.h"
-#include "types.c"
+#include "snapshot.c"
 
-#define ARENAMAX 1024
-#define LINEMAX  128
-#define TOKMAX   64
 #define SIGMAX   16
 
 // Disgusting hack in order to get quoted macros
 #define STRR(X) #X
 #define STR(X)  STRR(X)
 
-char line[LINEMAX+2];
-char *lineptr;
-char tok[TOKMAX];
-char *newstr;
-
 #define SPECIALCHAR(c) ((c)==':' || (c)=='=' || (c)=='<' || (c)==',' || (c)=='.' || (c)=='(' || (c)==')' || !(c))
-#define ERROR(s,...)   printf("\033[31merror:\033[37m " s "\n" __VA_OPT__(,) __VA_ARGS__)
+#define NONSPECIAL     '*'
+#define ERROR(jt,s,...) fprintf((jt)->out, "\033[31merror:\033[37m " s "\n" __VA_OPT__(,) __VA_ARGS__)
+
+// A line is lexed once, into toks[0..ntoks), which always ends with a
+// token of kind '\0' for the end of the line. The parsers consume the
+// tokens left to right with one token of lookahead, and never back up.
+
+typedef struct {
+  char kind;       // The special character, '\0' for the end of the
+                   // line, or NONSPECIAL for an identifier
+  symbol sym;      // The identifier, interned
+  size_t off;      // Position in the line
+  size_t len;
+} token;
+
+#define OUTBUFSIZE (1 << 20)
+
+// A method call statement queued to be resolved by the pool; see
+// runcalls()
+
+typedef struct {
+  char *line;          // Where the statement is, for error reports
+  char *lineend;
+  size_t lineno;
+  size_t caret;
+
+  object caller;
+  symbol name;
+  signature *sig;
+
+  bool failed;         // If set, errmsg says why (NULL for a parse error)
+  char *errmsg;
+  method *bestmeth;
+  method *meth;
+} call;
+
+// The inline cache of a method call site, i.e. of one caller, method
+// name and argument signature, as in "b.f(d)"; see parse_methodcall().
+// The compile-time resolution of
+// a site doesn't depend on anything that changes between runs of it,
+// so it is cached once. The run-time one depends on the caller's rtt,
+// and up to PICSIZE rtts are cached with what they dispatch to; after
+// that the site is megamorphic and only the compile-time resolution is
+// cached. All of it is dropped whenever the universe's epoch moves on,
+// and every site is dropped once there are SITEMAX of them, so that a
+// script of calls that each run once costs a bounded amount.
+
+#define PICSIZE 4
+#define SITEMAX 4096
+
+typedef struct {
+  uint32_t key[4];     // {caller, method name, signature id, 0}
+  signature *sig;
+  size_t epoch;        // The universe's epoch when the entries were made
+  method *bestmeth;    // NULL until the site has resolved once
+  size_t n;            // Entries in use
+  bool megamorphic;
+  type *rtts[PICSIZE];
+  method *meths[PICSIZE];
+  size_t hits, misses;
+} callsite;
+
+struct _worker;
+
+// Everything a javatype instance works on: its universe, the parser
+// and the output. Instances share nothing, so each can run on a thread
+// of its own.
+
+typedef struct {
+  universe *u;
+
+  // The line being parsed is the bytes [line, lineend). It is not
+  // zero-terminated, and may point straight into a mapped file.
+  char *line;
+  char *lineend;
+  size_t lineno;
+  bool batch;        // Lines are not echoed, so errors show theirs
+
+  token *toks;
+  size_t ntoks, tokcap;
+  size_t tokp;       // Next token to consume
+  size_t caret;      // Where to point at on error: just past the last
+                     // token consumed
+  symbol toksym;     // Symbol of the last token consumed
+
+  symbol *recvs;     // The callers of a batch call, and what the call
+  method **recvmeths;// dispatches to for each; see parse_batchcall()
+  size_t recvcap;
+
+  arena sitemem;     // Owns sites and their keys
+  hashtable sites;   // callsite key -> callsite
+
+  FILE *out;
+  bool json;         // See emittype()
+  char *outbuf;      // OUTBUFSIZE bytes of pending JSON output
+  size_t outlen;
+
+  // Calls over a frozen universe, while in jtrun(), are queued and
+  // resolved by a pool of nthreads threads (this one included)
+  bool inrun;
+  int nthreads;
+  call *calls;
+  size_t ncalls, callcap;
+  struct _worker *workers;
+  pthread_mutex_t poollock;
+  pthread_cond_t poolgo;     // poolgen has changed, or poolquit is set
+  pthread_cond_t pooldone;   // poolbusy has dropped to 0
+  size_t poolgen;
+  int poolbusy;              // Number of threads still working
+  bool poolquit;
+} javatype;
+
+void tokenize(javatype *jt) {
+  char *p, *s;
+  token *t;
+
+  jt->ntoks = 0;
+  p = jt->line;
+  while (1) {
+    for (; p < jt->lineend && (*p == ' ' || *p == '\t'); p++);
+    if (jt->ntoks == jt->tokcap) {
+      jt->tokcap = jt->tokcap ? jt->tokcap << 1 : 64;
+      jt->toks = realloc(jt->toks, jt->tokcap * sizeof(token));
+    }
+    t = jt->toks + jt->ntoks++;
+    t->off = p - jt->line;
+    t->sym = 0;
+
+    if (p >= jt->lineend) {        // The end of the line takes up one
+      t->kind = '\0';          // character, so that a caret after it
+      t->len = 1;              // lands one past the last one
+      break;
+    }
 
-void nexttok() {
-  char *s;
+    if (SPECIALCHAR(*p)) {
+      t->kind = *p++;
+      t->len = 1;
+      continue;
+    }
+
+    for (s = p; p < jt->lineend && *p != ' ' && *p != '\t' && !SPECIALCHAR(*p); p++);
+    t->kind = NONSPECIAL;
+    t->len = p - s;
+    t->sym = internn(&jt->u->syms, s, t->len);
+  }
+  jt->tokp = 0;
+  jt->caret = 0;
+}
+
+// Whether the next token is of kind c, without consuming it
+bool peek(javatype *jt, char c) {
+  return jt->toks[jt->tokp].kind == c;
+}
+
+// Consume the next token if it is of kind c. The end of the line is
+// never consumed past.
+bool expect(javatype *jt, char c) {
+  token *t;
+  t = jt->toks + jt->tokp;
+  if (t->kind != c) return false;
+  jt->toksym = t->sym;
+  jt->caret = t->off + t->len;
+  if (jt->tokp < jt->ntoks - 1) jt->tokp++;
+  return true;
+}
+
+bool expectstr(javatype *jt, char *s) {
+  token *t;
+  t = jt->toks + jt->tokp;
+  if (t->kind != NONSPECIAL || t->len != strlen(s) || memcmp(jt->line + t->off, s, t->len)) return false;
+  return expect(jt, NONSPECIAL);
+}
+
+// Output
+//
+// By default output is for people, with colours. With -j, each
+// statement that produces anything writes one JSON object on its own
+// line instead, with no colours or cursor movement, through outbuf
+// rather than through stdio:
+//
+//   {"kind":"type","name":"B","super":"A"}
+//   {"kind":"method","type":"A","name":"f","params":["Object"],"return":null}
+//   {"kind":"object","name":"b","ctt":"A","rtt":"B"}
+//   {"kind":"call","object":"b","method":"f","args":["A"],
+//    "ctt":{"type":"A","params":["Object"]},"rtt":{"type":"B","params":["Object"]}}
+//   {"kind":"batch","method":"f","args":["A"],
+//    "rtt":[{"type":"A","params":["Object"]},{"object":"x","error":"uninitialised caller"}]}
+//   {"kind":"error","line":3,"col":23,"message":"no matching signature"}
+//
+// (calls are single lines; they are split here to fit). col is the byte
+// offset in the line that a caret would point at. The ? dumps stay
+// human-readable.
+
+void outflush(javatype *jt) {
+  fwrite(jt->outbuf, 1, jt->outlen, jt->out);
+  jt->outlen = 0;
+}
+
+void outn(javatype *jt, char *s, size_t n) {
+  if (jt->outlen + n > OUTBUFSIZE) {
+    outflush(jt);
+    if (n > OUTBUFSIZE) { fwrite(s, 1, n, jt->out); return; }
+  }
+  memcpy(jt->outbuf + jt->outlen, s, n);
+  jt->outlen += n;
+}
+
+void outs(javatype *jt, char *s) {
+  outn(jt, s, strlen(s));
+}
+
+void outnum(javatype *jt, size_t n) {
+  char buf[24];
+  outn(jt, buf, snprintf(buf, sizeof(buf), "%zu", n));
+}
+
+// s as a JSON string, or null
+void outq(javatype *jt, char *s) {
+  char buf[8];
+
+  if (!s) { outs(jt, "null"); return; }
+  outn(jt, "\"", 1);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { outn(jt, "\\", 1); outn(jt, s, 1); }
+    else if ((unsigned char)*s < 0x20) outn(jt, buf, snprintf(buf, sizeof(buf), "\\u%04x", *s));
+    else outn(jt, s, 1);
+  }
+  outn(jt, "\"", 1);
+}
+
+void outsig(javatype *jt, signature *sig) {
+  type **t;
+  outn(jt, "[", 1);
+  for (t = sig->types; *t; t++) {
+    if (t != sig->types) outn(jt, ",", 1);
+    outq(jt, (*t)->name);
+  }
+  outn(jt, "]", 1);
+}
+
+void emittype(javatype *jt, char *name, char *super) {
+  if (!jt->json) { fprintf(jt->out, "- %s <: %s\n", name, super); return; }
+  outs(jt, "{\"kind\":\"type\",\"name\":"); outq(jt, name);
+  outs(jt, ",\"super\":"); outq(jt, super);
+  outs(jt, "}\n");
+}
+
+void emitmethod(javatype *jt, type *calltype, symbol name, signature *sig, type *rettype) {
+  if (!jt->json) return;
+  outs(jt, "{\"kind\":\"method\",\"type\":"); outq(jt, calltype->name);
+  outs(jt, ",\"name\":"); outq(jt, symname(&jt->u->syms, name));
+  outs(jt, ",\"params\":"); outsig(jt, sig);
+  outs(jt, ",\"return\":"); outq(jt, rettype ? rettype->name : NULL);
+  outs(jt, "}\n");
+}
 
-  for (; *lineptr == ' ' || *lineptr == '\t'; lineptr++);
-  if (SPECIALCHAR(*lineptr)) {
-    tok[0] = *lineptr;
-    tok[1] = '\0';
-    lineptr++;
+void emitobject(javatype *jt, char *name, type *ctt, type *rtt) {
+  if (!jt->json) {
+    fprintf(jt->out, "- %s : %s (rtt=%s)\n", name, ctt->name, rtt ? rtt->name : "nil");
     return;
   }
+  outs(jt, "{\"kind\":\"object\",\"name\":"); outq(jt, name);
+  outs(jt, ",\"ctt\":"); outq(jt, ctt->name);
+  outs(jt, ",\"rtt\":"); outq(jt, rtt ? rtt->name : NULL);
+  outs(jt, "}\n");
+}
 
-  s = tok;
-  while (1) {
-    if (*lineptr == ' ' || *lineptr == '\t') break;
-    if (SPECIALCHAR(*lineptr)) break;
-    *s = *lineptr;
-    s++; lineptr++;
-  };
+void emitcall(javatype *jt, object *caller, symbol name, signature *sig, method *bestmeth, method *meth) {
+  if (!jt->json) {
+    fprintf(jt->out, "- %s.%s(", caller->name, symname(&jt->u->syms, name));
+    dumpsig(jt->out, sig);
+    fprintf(jt->out, ") -> %s::%s(", bestmeth->calltype->name, symname(&jt->u->syms, name));
+    dumpsig(jt->out, bestmeth->sig);
+    fprintf(jt->out, ") (ctt) -> %s::%s(", meth->calltype->name, symname(&jt->u->syms, name));
+    dumpsig(jt->out, meth->sig);
+    fprintf(jt->out, ") (rtt)\n");
+    return;
+  }
+  outs(jt, "{\"kind\":\"call\",\"object\":"); outq(jt, caller->name);
+  outs(jt, ",\"method\":"); outq(jt, symname(&jt->u->syms, name));
+  outs(jt, ",\"args\":"); outsig(jt, sig);
+  outs(jt, ",\"ctt\":{\"type\":"); outq(jt, bestmeth->calltype->name);
+  outs(jt, ",\"params\":"); outsig(jt, bestmeth->sig);
+  outs(jt, "},\"rtt\":{\"type\":"); outq(jt, meth->calltype->name);
+  outs(jt, ",\"params\":"); outsig(jt, meth->sig);
+  outs(jt, "}}\n");
+}
 
-  *s++ = '\0';
+// Why the call obj.name(sig) fails, for a caller of a batch call that
+// batchresolve() could not resolve
+char *batcherror(javatype *jt, symbol obj, symbol name, signature *sig) {
+  object caller;
+  method *bestmeth, *meth;
+
+  jt->u->errmsg = NULL;
+  if (!getobject(jt->u, obj, &caller)) return "undefined caller";
+  if (!caller.rtt) return "uninitialised caller";
+  if (cttresolve(jt->u, name, caller.ctt, sig, &bestmeth)) rttresolve(jt->u, bestmeth, caller.rtt, &meth);
+  return jt->u->errmsg ? jt->u->errmsg : "parsing";
 }
 
-#define NONSPECIAL     '*'
-bool expect(char c) {
-  char *s;
-  s = lineptr;
-  nexttok();
-  if ((*tok == c) || (c == NONSPECIAL && !SPECIALCHAR(*tok))) return true;
-  lineptr = s;
-  return false;
+// The methods a batch call dispatches to, in the order of its callers,
+// with why it fails for those it does
+void emitbatch(javatype *jt, symbol *objs, symbol name, signature *sig, method **meths, size_t n) {
+  size_t i;
+
+  if (!jt->json) {
+    fprintf(jt->out, "- batch %s(", symname(&jt->u->syms, name));
+    dumpsig(jt->out, sig);
+    fprintf(jt->out, ") ->");
+    for (i = 0; i < n; i++) {
+      fprintf(jt->out, i ? ", " : " ");
+      if (!meths[i]) {
+        fprintf(jt->out, "%s: %s", symname(&jt->u->syms, objs[i]), batcherror(jt, objs[i], name, sig));
+        continue;
+      }
+      fprintf(jt->out, "%s::%s(", meths[i]->calltype->name, symname(&jt->u->syms, name));
+      dumpsig(jt->out, meths[i]->sig);
+      fprintf(jt->out, ")");
+    }
+    fprintf(jt->out, " (rtt)\n");
+    return;
+  }
+  outs(jt, "{\"kind\":\"batch\",\"method\":"); outq(jt, symname(&jt->u->syms, name));
+  outs(jt, ",\"args\":"); outsig(jt, sig);
+  outs(jt, ",\"rtt\":[");
+  for (i = 0; i < n; i++) {
+    if (i) outs(jt, ",");
+    if (!meths[i]) {
+      outs(jt, "{\"object\":"); outq(jt, symname(&jt->u->syms, objs[i]));
+      outs(jt, ",\"error\":"); outq(jt, batcherror(jt, objs[i], name, sig));
+      outs(jt, "}");
+      continue;
+    }
+    outs(jt, "{\"type\":"); outq(jt, meths[i]->calltype->name);
+    outs(jt, ",\"params\":"); outsig(jt, meths[i]->sig);
+    outs(jt, "}");
+  }
+  outs(jt, "]}\n");
 }
 
-bool expectstr(char *s) {
-  char *s1;
-  s1 = lineptr;
-  nexttok();
-  if (strcmp(tok, s) == 0) return true;
-  lineptr = s1;
-  return false;
+// Report errmsg for the current line, pointing at caret
+void emiterror(javatype *jt) {
+  size_t i;
+
+  if (jt->json) {
+    outs(jt, "{\"kind\":\"error\",\"line\":"); outnum(jt, jt->lineno);
+    outs(jt, ",\"col\":"); outnum(jt, jt->caret);
+    outs(jt, ",\"message\":"); outq(jt, jt->u->errmsg ? jt->u->errmsg : "parsing");
+    outs(jt, "}\n");
+    return;
+  }
+
+  // Batch mode doesn't echo its input, so show the offending line
+  if (jt->batch) fprintf(jt->out, "line %zu:\n> %.*s\n", jt->lineno, (int)(jt->lineend - jt->line), jt->line);
+  fprintf(jt->out, "  ");
+  for (i = 0; i < jt->caret; i++) fputc(' ', jt->out);
+  fprintf(jt->out, "^\n");
+  if (jt->u->errmsg) ERROR(jt, "%s", jt->u->errmsg);
+  else        ERROR(jt, "parsing");
 }
 
-bool parse_typedecl() {
-  // tok1 is the previous type parsed,
+bool parse_typedecl(javatype *jt) {
+  // sym1 is the previous type parsed,
   // tok  is the current type
-  char tok1[TOKMAX];
+  symbol sym1;
   type *t, *t1;
 
 start:  // Start parsing a new chain of types
-  *tok1 = '\0';
+  sym1 = 0;
   goto first;
 
 loop:
-  if (expect(',')) {
-    printf("- %s <: Object\n", tok1);
+  if (expect(jt, ',')) {
+    emittype(jt, symname(&jt->u->syms, sym1), "Object");
     goto start;
   }
 
-  else if (expect('<')) {
+  else if (expect(jt, '<')) {
 first:
-    if (!expect(NONSPECIAL)) return false;
+    if (!expect(jt, NONSPECIAL)) return false;
 
-    if (gettype(tok)) { errmsg = "type is already defined"; return false; }
+    if (gettype(jt->u, jt->toksym)) { jt->u->errmsg = "type is already defined"; return false; }
 
-    if (!creattype(tok, "Object")) return false;
+    if (!creattype(jt->u, jt->toksym, intern(&jt->u->syms, "Object"))) return false;
 
-skip:
-    if (*tok1) {               // Update previous type's parent
-      t = gettype(tok);
-      t1 = gettype(tok1);
+    if (sym1) {                // Update previous type's parent
+      t = gettype(jt->u, jt->toksym);
+      t1 = gettype(jt->u, sym1);
       assert(t);
       assert(t1);
-      t1->super = t;
-      printf("- %s <: %s\n", tok1, tok);
+      settypesuper(jt->u, t1, t);
+      emittype(jt, t1->name, t->name);
     }
 
-    strcpy(tok1, tok);
+    sym1 = jt->toksym;
     goto loop;
   }
 
-  else if (expect('\0')) {
-    if (*tok1) printf("- %s <: Object\n", tok1);
+  else if (expect(jt, '\0')) {
+    if (sym1) emittype(jt, symname(&jt->u->syms, sym1), "Object");
   }
 
   else return false;
@@ -111,63 +428,59 @@ skip:
 
 // A method declaration is a statement of the form
 // Type::method(Type1, Type2, ...)
+//
+// The calling type has already been consumed, and is typesym.
 
-bool parse_methoddecl() {
-  char tok1[TOKMAX];
+bool parse_methoddecl(javatype *jt, symbol typesym) {
+  symbol sym1;
   type *calltype;
   type *rettype;
   type *t;
-  type **sig;
+  type *sig[SIGMAX+1];
   int i;
 
-  if (!expect(NONSPECIAL)) return false;    // Calling type
-  calltype = gettype(tok);
-  if (!calltype) { errmsg = "undefined calling type"; return false; }
+  calltype = gettype(jt->u, typesym);                // Calling type
+  if (!calltype) { jt->u->errmsg = "undefined calling type"; return false; }
 
-  if (!expect(':')) return false;
-  if (!expect(':')) return false;
+  if (!expect(jt, ':')) return false;
+  if (!expect(jt, ':')) return false;
 
-  if (!expect(NONSPECIAL)) return false;    // Method name
-  strcpy(tok1, tok);
+  if (!expect(jt, NONSPECIAL)) return false;    // Method name
+  sym1 = jt->toksym;
 
-  if (!expect('(')) return false;
-
-  sig = malloc((SIGMAX+1) * sizeof(type *));
-  if (expect(')')) goto skip;
+  if (!expect(jt, '(')) return false;
 
   i = 0;
+  if (expect(jt, ')')) goto skip;
+
   while (1) {
-    if (i >= SIGMAX) { free(sig); errmsg = "too many parameters; maximum allowed is " STR(SIGMAX); return false; }
+    if (i >= SIGMAX) { jt->u->errmsg = "too many parameters; maximum allowed is " STR(SIGMAX); return false; }
 
-    if (!expect(NONSPECIAL)) { free(sig); return false; }  // Parameter type
-    t = gettype(tok);
-    if (!t) { free(sig); errmsg = "undefined parameter type"; return false; }
+    if (!expect(jt, NONSPECIAL)) return false;  // Parameter type
+    t = gettype(jt->u, jt->toksym);
+    if (!t) { jt->u->errmsg = "undefined parameter type"; return false; }
     sig[i++] = t;
 
-    if (expect(')')) break;
-    else if (expect(',')) continue;
-    else { free(sig); return false; }
+    if (expect(jt, ')')) break;
+    else if (expect(jt, ',')) continue;
+    else return false;
   }
-  sig[i] = NULL;
 
 skip:
-  if (expect('\0')) rettype = NULL;         // void return type
+  sig[i] = NULL;
+
+  if (expect(jt, '\0')) rettype = NULL;         // void return type
 
-  else if (expectstr("return")) {           // Nonempty return type
-    if (!expect(NONSPECIAL)) { free(sig); return false; }
-    rettype = gettype(tok);
-    if (!rettype) { free(sig); errmsg = "undefined return type"; return false; }
+  else if (expectstr(jt, "return")) {           // Nonempty return type
+    if (!expect(jt, NONSPECIAL)) return false;
+    rettype = gettype(jt->u, jt->toksym);
+    if (!rettype) { jt->u->errmsg = "undefined return type"; return false; }
   }
 
   else return false;
 
-  if (!creatmethod(tok1, calltype, sig, rettype)) return false;
-
-  //printf("- %s::%s(", calltype->name, tok1);
-  //dumpsig(sig);
-  //printf(")");
-  //if (rettype) printf(" return %s\n", rettype->name);
-  //else         printf("\n");
+  if (!creatmethod(jt->u, sym1, calltype, internsig(jt->u, sig), rettype)) return false;
+  emitmethod(jt, calltype, sym1, internsig(jt->u, sig), rettype);
   return true;
 }
 
@@ -177,30 +490,27 @@ skip:
 //
 // Returns the appropriate type in resulttype.
 
-bool parse_object(type **resulttype) {
-  char tok1[TOKMAX];
+bool parse_object(javatype *jt, type **resulttype) {
   type *t;
-  object *o;
+  object o;
 
-  if (expect('(')) {
-    if (!expect(NONSPECIAL)) return false;
-    t = gettype(tok);
-    if (!t) { errmsg = "undefined cast type"; return false; }
+  if (expect(jt, '(')) {
+    if (!expect(jt, NONSPECIAL)) return false;
+    t = gettype(jt->u, jt->toksym);
+    if (!t) { jt->u->errmsg = "undefined cast type"; return false; }
 
-    if (!expect(')')) return false;
+    if (!expect(jt, ')')) return false;
 
-    if (!expect(NONSPECIAL)) return false;
-    o = getobject(tok);
-    if (!o) { errmsg = "undefined object"; return false; }
-    if (!issubtype(o->rtt, t)) { errmsg = "object's rtt not a subtype of cast type"; return false; }
-    if (!issubtype(t, o->ctt)) { errmsg = "cast type not a subtype of object's ctt"; return false; }
+    if (!expect(jt, NONSPECIAL)) return false;
+    if (!getobject(jt->u, jt->toksym, &o)) { jt->u->errmsg = "undefined object"; return false; }
+    if (!issubtype(jt->u, o.rtt, t)) { jt->u->errmsg = "object's rtt not a subtype of cast type"; return false; }
+    if (!issubtype(jt->u, t, o.ctt)) { jt->u->errmsg = "cast type not a subtype of object's ctt"; return false; }
     *resulttype = t;
   }
 
-  else if (expect(NONSPECIAL)) {
-    o = getobject(tok);
-    if (!o) { errmsg = "undefined object"; return false; }
-    *resulttype = o->ctt;
+  else if (expect(jt, NONSPECIAL)) {
+    if (!getobject(jt->u, jt->toksym, &o)) { jt->u->errmsg = "undefined object"; return false; }
+    *resulttype = o.ctt;
   }
 
   else return false;
@@ -208,65 +518,150 @@ bool parse_object(type **resulttype) {
   return true;
 }
 
-// A method call is an expression of the form
-// obj.method(param1, param2, ...)
+// The part of a method call after the caller:
+// .method(param1, param2, ...)
 //
-// Performs dynamic dispatching and returns the appropriate return
-// type in resulttype.
+// Returns the method name and argument signature.
 
-bool parse_methodcall(type **resulttype) {
-  char tok1[TOKMAX];
-  object *caller;
-  object *o;
+bool parse_callee(javatype *jt, symbol *namep, signature **sigp) {
+  symbol sym1;
   int i;
 
-  type **sig;
-  type **bestsig;
-  type *besttype;
-  type *bestbesttype;
-  method *meth;
-
-  if (!expect(NONSPECIAL)) return false;             // Calling object
-  caller = getobject(tok);
-  if (!caller) { errmsg = "undefined caller"; return false; }
+  type *types[SIGMAX+1];
 
-  if (!expect('.')) return false;
-  if (!expect(NONSPECIAL)) return false;             // Method name
-  strcpy(tok1, tok);
+  if (!expect(jt, '.')) return false;
+  if (!expect(jt, NONSPECIAL)) return false;             // Method name
+  sym1 = jt->toksym;
 
-  if (!expect('(')) return false;
+  if (!expect(jt, '(')) return false;
   i = 0;
 
-  sig = malloc((SIGMAX+1) * sizeof(type *));
-  if (expect(')')) goto skip;
+  if (expect(jt, ')')) goto skip;
 
   while (1) {
-    if (i >= SIGMAX) { free(sig); errmsg = "too many parameters; maximum is " STR(SIGMAX); return false; }
+    if (i >= SIGMAX) { jt->u->errmsg = "too many parameters; maximum is " STR(SIGMAX); return false; }
 
-    if (!parse_object(sig+(i++))) { free(sig); return false; }  // Parameter
+    if (!parse_object(jt, types+(i++))) return false;  // Parameter
 
-    if (expect(')')) break;
-    else if (expect(',')) continue;
-    else { free(sig); return false; }
+    if (expect(jt, ')')) break;
+    else if (expect(jt, ',')) continue;
+    else return false;
   }
-  sig[i] = NULL;
 
 skip:
-  if (!caller->rtt) { free(sig); errmsg = "uninitialised caller"; return false; }
-  if (!cttresolve(tok1, caller->ctt, sig, &besttype, &bestsig)) { free(sig); return false; }
-  if (!rttresolve(tok1, caller->rtt, besttype, bestsig, &bestbesttype, &meth)) { free(sig); return false; }
-
-  printf("- %s.%s(", caller->name, tok1);
-  dumpsig(sig);
-  printf(") -> %s::%s(", besttype->name, tok1);
-  dumpsig(bestsig);
-  printf(") (ctt) -> %s::%s(", bestbesttype->name, tok1);
-  dumpsig(bestsig);
-  printf(") (rtt)\n");
-  free(sig);
+  types[i] = NULL;
+  *namep = sym1;
+  *sigp = internsig(jt->u, types);
   return true;
 }
 
+// A method call is an expression of the form
+// obj.method(param1, param2, ...)
+//
+// Parses the call without resolving it, returning the calling object,
+// method name and argument signature. The calling object has already
+// been consumed, and is objsym.
+
+bool parse_call(javatype *jt, symbol objsym, object *callerp, symbol *namep, signature **sigp) {
+  if (!getobject(jt->u, objsym, callerp)) { jt->u->errmsg = "undefined caller"; return false; } // Calling object
+  if (!parse_callee(jt, namep, sigp)) return false;
+  if (!callerp->rtt) { jt->u->errmsg = "uninitialised caller"; return false; }
+  return true;
+}
+
+// The inline cache of obj.name(sig), made empty if it is new
+static callsite *getsite(javatype *jt, symbol obj, symbol name, signature *sig) {
+  callsite *site;
+  uint32_t key[4];
+
+  key[0] = obj;
+  key[1] = name;
+  key[2] = sig->key[0];
+  key[3] = 0;
+  site = htfind(&jt->sites, (char *)key);
+  if (site) return site;
+  if (jt->sites.items >= SITEMAX) {
+    areset(&jt->sitemem);
+    htinitmem(&jt->sites, sizeof(uint32_t), &jt->sitemem);
+  }
+  site = aalloc(&jt->sitemem, sizeof(callsite));
+  memcpy(site->key, key, sizeof(key));
+  site->sig = sig;
+  htinsert(&jt->sites, (char *)site->key, site);
+  return site;
+}
+
+// Parse a method call as parse_call() does, then perform dynamic
+// dispatching and return the appropriate return type in resulttype.
+//
+// The resolutions go through the inline cache of the call, so that a
+// call run over and over skips both cttresolve() and
+// rttresolve() for as long as its caller keeps to a few rtts. Failed
+// resolutions are not cached.
+
+bool parse_methodcall(javatype *jt, symbol objsym, type **resulttype) {
+  symbol sym1;
+  object caller;
+  signature *sig;
+  method *bestmeth;
+  method *meth;
+  callsite *site;
+  size_t i;
+
+  if (!parse_call(jt, objsym, &caller, &sym1, &sig)) return false;
+  site = getsite(jt, objsym, sym1, sig);
+  if (site->epoch != jt->u->epoch) {
+    site->epoch = jt->u->epoch;
+    site->bestmeth = NULL;
+    site->n = 0;
+    site->megamorphic = false;
+  }
+
+  for (i = 0; i < site->n; i++)
+    if (site->rtts[i] == caller.rtt) {
+      site->hits++;
+      bestmeth = site->bestmeth;
+      meth = site->meths[i];
+      goto emit;
+    }
+
+  site->misses++;
+  if (!site->bestmeth && !cttresolve(jt->u, sym1, caller.ctt, sig, &site->bestmeth)) return false;
+  bestmeth = site->bestmeth;
+  if (!rttresolve(jt->u, bestmeth, caller.rtt, &meth)) return false;
+  if (site->n < PICSIZE) {
+    site->rtts[site->n] = caller.rtt;
+    site->meths[site->n++] = meth;
+  }
+  else site->megamorphic = true;
+
+emit:
+  emitcall(jt, &caller, sym1, sig, bestmeth, meth);
+  *resulttype = meth->rettype;
+  return true;
+}
+
+// ?c: the inline caches, with how often each has hit and missed. Those
+// from before the last change of epoch are left out, since their
+// symbols and signatures may have been undone since.
+void dumpsites(javatype *jt) {
+  hashtable_entry *e;
+  callsite *site;
+
+  for (e = jt->sites.entries; e < jt->sites.entries + jt->sites.capacity; e++) {
+    if (!e->occupied) continue;
+    site = e->value;
+    if (site->epoch != jt->u->epoch) continue;
+    fprintf(jt->out, "- %s.%s(", symname(&jt->u->syms, site->key[0]), symname(&jt->u->syms, site->key[1]));
+    dumpsig(jt->out, site->sig);
+    fprintf(jt->out, "): %zu hits, %zu misses, ", site->hits, site->misses);
+    if (!site->n) fprintf(jt->out, "empty\n");
+    else if (site->megamorphic) fprintf(jt->out, "megamorphic\n");
+    else if (site->n == 1) fprintf(jt->out, "monomorphic\n");
+    else fprintf(jt->out, "polymorphic (%zu rtts)\n", site->n);
+  }
+}
+
 // A 'rhs' is an expression of the form
 // Case 1: obj                             or
 // Case 2: (Type)obj                       or
@@ -275,48 +670,42 @@ skip:
 //
 // Returns the type that the expression evaluates to in rtt.
 
-bool parse_rhs(type **rtt) {
-  char tok1[TOKMAX];
+bool parse_rhs(javatype *jt, type **rtt) {
+  symbol sym1;
   type *t;
-  object *o;
-  type *sig;
-  char *s;
+  object o;
 
-  s = lineptr;
+  if (expect(jt, '(')) {           // CASE 2, typecast
+    if (!expect(jt, NONSPECIAL)) return false;
+    t = gettype(jt->u, jt->toksym);
+    if (!t) { jt->u->errmsg = "undefined cast type"; return false; }
 
-  if (expect('(')) {           // CASE 2, typecast
-    if (!expect(NONSPECIAL)) return false;
-    t = gettype(tok);
-    if (!t) { errmsg = "undefined cast type"; return false; }
+    if (!expect(jt, ')')) return false;
 
-    if (!expect(')')) return false;
-
-    if (!expect(NONSPECIAL)) return false;
-    o = getobject(tok);
-    if (!o) { errmsg = "undefined object"; return false; }
-    if (!issubtype(o->rtt, t)) { errmsg = "object's rtt not a subtype of cast type"; return false; }
+    if (!expect(jt, NONSPECIAL)) return false;
+    if (!getobject(jt->u, jt->toksym, &o)) { jt->u->errmsg = "undefined object"; return false; }
+    if (!issubtype(jt->u, o.rtt, t)) { jt->u->errmsg = "object's rtt not a subtype of cast type"; return false; }
     *rtt = t;
   }
 
-  else if (expect(NONSPECIAL)) {
-    strcpy(tok1, tok);
+  else if (expect(jt, NONSPECIAL)) {
+    sym1 = jt->toksym;
 
-    if (expect('\0')) {        // CASE 1, object, tok1 = object name
-      o = getobject(tok1);
-      if (!o) { errmsg = "undefined object"; return false; }
-      *rtt = o->rtt;
+    if (expect(jt, '\0')) {        // CASE 1, object, sym1 = object name
+      if (!getobject(jt->u, sym1, &o)) { jt->u->errmsg = "undefined object"; return false; }
+      *rtt = o.rtt;
     }
 
-    else if (expect('(')) {    // CASE 3, constructor, tok1 = type name
-      t = gettype(tok1);
-      if (!t) { errmsg = "undefined type"; return false; }
-      if (!expect(')')) return false;
+    else if (expect(jt, '(')) {    // CASE 3, constructor, sym1 = type name
+      t = gettype(jt->u, sym1);
+      if (!t) { jt->u->errmsg = "undefined type"; return false; }
+      if (!expect(jt, ')')) return false;
       *rtt = t;
     }
 
-    else if (expect('.')) {    // CASE 4, method call, tok1 = object name
-      lineptr = s;
-      if (!parse_methodcall(rtt)) return false;
+    else if (peek(jt, '.')) {      // CASE 4, method call, sym1 = object name
+      if (!parse_methodcall(jt, sym1, rtt)) return false;
+      if (!*rtt) { jt->u->errmsg = "method returns nothing"; return false; }
     }
 
     else return false;
@@ -329,144 +718,452 @@ bool parse_rhs(type **rtt) {
 
 // An object assignment is a statement of the form
 // obj = <rhs>
+//
+// The object has already been consumed, and is objsym.
 
-bool parse_objectasgn() {
-  object *o;
+bool parse_objectasgn(javatype *jt, symbol objsym) {
+  object o;
   type *resulttype;
 
-  if (!expect(NONSPECIAL)) return false;
-  o = getobject(tok);
-  if (!o) { errmsg = "undefined object"; return false; }
+  if (!getobject(jt->u, objsym, &o)) { jt->u->errmsg = "undefined object"; return false; }
 
-  if (!expect('=')) return false;
+  if (!expect(jt, '=')) return false;
 
-  if (!parse_rhs(&resulttype)) return false;
-  if (!issubtype(resulttype, o->ctt)) { errmsg = "rhs is not a subtype of object's ctt"; return false; }
-  o->rtt = resulttype;
-  printf("- %s : %s (rtt=%s)\n", o->name, o->ctt->name, o->rtt->name);
+  if (!parse_rhs(jt, &resulttype)) return false;
+  if (!issubtype(jt->u, resulttype, o.ctt)) { jt->u->errmsg = "rhs is not a subtype of object's ctt"; return false; }
+  setobjectrtt(jt->u, objsym, resulttype);
+  emitobject(jt, o.name, o.ctt, resulttype);
   return true;
 }
 
 // An object declaration is a statement of the form
 // Case 1: Type obj          or
 // Case 2: Type obj = <rhs>
+//
+// The type has already been consumed, and is typesym.
 
-bool parse_objectdecl() {
-  char tok1[64];
+bool parse_objectdecl(javatype *jt, symbol typesym) {
+  symbol sym1;
   type *ctt, *rtt;
 
-  if (!expect(NONSPECIAL)) return false;  // Type name
-  ctt = gettype(tok);
-  if (!ctt) { errmsg = "undefined type"; return false; }
+  ctt = gettype(jt->u, typesym);                 // Type name
+  if (!ctt) { jt->u->errmsg = "undefined type"; return false; }
 
-  if (!expect(NONSPECIAL)) return false;  // Object name
-  strcpy(tok1, tok);
+  if (!expect(jt, NONSPECIAL)) return false;  // Object name
+  sym1 = jt->toksym;
 
-  if (expect('\0')) rtt = NULL;           // CASE 1
-  else if (expect('=')) {                 // CASE 2
-    if (!parse_rhs(&rtt)) return false;
+  if (expect(jt, '\0')) rtt = NULL;           // CASE 1
+  else if (expect(jt, '=')) {                 // CASE 2
+    if (!parse_rhs(jt, &rtt)) return false;
   }
   else return false;
 
   if (rtt)
-    if (!issubtype(rtt, ctt)) { errmsg = "rhs not a subtype of lhs"; return false; }
-  if (!creatobject(tok1, ctt, rtt)) return false;
-  if (rtt) printf("- %s : %s (rtt=%s)\n", tok1, ctt->name, rtt->name);
-  else     printf("- %s : %s (rtt=nil)\n", tok1, ctt->name);
+    if (!issubtype(jt->u, rtt, ctt)) { jt->u->errmsg = "rhs not a subtype of lhs"; return false; }
+  if (!creatobject(jt->u, sym1, ctt, rtt)) return false;
+  emitobject(jt, symname(&jt->u->syms, sym1), ctt, rtt);
   return true;
 }
 
-void help() {
-  printf("? to print this help message\n");
-  printf("q to quit\n");
-  printf("?t to dump types\n");
-  printf("?o to dump objects\n");
-  printf("?v to dump all methods (v for vtable)\n");
-  printf("To learn the basic syntax, view test.txt\n");
+// A batch call is a statement of the form
+// batch obj1, obj2, ..., objn.method(param1, param2, ...)
+//
+// It resolves the call for every caller at once through batchresolve(),
+// and prints what each one dispatches to, in order, as a single list,
+// with the error for each caller the call fails for. It does not go
+// through the inline caches.
+
+bool parse_batchcall(javatype *jt) {
+  symbol name;
+  signature *sig;
+  size_t n;
+
+  n = 0;
+  while (1) {
+    if (!expect(jt, NONSPECIAL)) return false;    // Caller
+    if (n == jt->recvcap) {
+      jt->recvcap = jt->recvcap ? jt->recvcap << 1 : 64;
+      jt->recvs = realloc(jt->recvs, jt->recvcap * sizeof(symbol));
+      jt->recvmeths = realloc(jt->recvmeths, jt->recvcap * sizeof(method *));
+    }
+    jt->recvs[n++] = jt->toksym;
+    if (peek(jt, '.')) break;
+    if (!expect(jt, ',')) return false;
+  }
+  if (!parse_callee(jt, &name, &sig)) return false;
+  if (!expect(jt, '\0')) return false;
+  batchresolve(jt->u, name, sig, jt->recvs, n, jt->recvmeths);
+  emitbatch(jt, jt->recvs, name, sig, jt->recvmeths, n);
+  return true;
 }
 
-int main(int argc, char **argv) {
-  FILE *fp;
-  char tok1[TOKMAX];
-  int i;
-  char *s;
+void help(javatype *jt) {
+  fprintf(jt->out, "? to print this help message\n");
+  fprintf(jt->out, "q to quit\n");
+  fprintf(jt->out, "?t to dump types\n");
+  fprintf(jt->out, "?o to dump objects\n");
+  fprintf(jt->out, "?v to dump all methods (v for vtable)\n");
+  fprintf(jt->out, "?m to show memory use\n");
+  fprintf(jt->out, "?c to dump the inline caches of method calls\n");
+  fprintf(jt->out, "reset to forget all types, methods and objects\n");
+  fprintf(jt->out, "freeze to stop any more types or methods being declared\n");
+  fprintf(jt->out, "save <file> to save everything declared so far as a snapshot\n");
+  fprintf(jt->out, "load <file> to replace everything with a saved snapshot\n");
+  fprintf(jt->out, "{ to open a scope, and } to close it and drop the objects declared in it\n");
+  fprintf(jt->out, "checkpoint to note where things stand\n");
+  fprintf(jt->out, "rollback to undo everything since the last checkpoint\n");
+  fprintf(jt->out, "commit to drop the last checkpoint, keeping what was done since\n");
+  fprintf(jt->out, "batch a, b, c.f(x) to resolve one call for many callers at once\n");
+  fprintf(jt->out, "To learn the basic syntax, view test.txt\n");
+}
 
-  setuptypes();
+// Parallel resolution
+//
+// Once the universe is frozen, the only thing method call statements
+// change is the output, so a run of them can be resolved in any order.
+// jtrun() queues them in calls[] (parsing them as it goes, since that
+// interns names and signatures) until some other kind of statement
+// comes along, and runcalls() then has the pool resolve them all and
+// emits the results in their original order.
+//
+// The queue is cut into chunks of CALLCHUNK calls, and each thread is
+// handed an equal range of chunks. A thread takes chunks from the front
+// of its own range, and once that is empty steals from the back of the
+// other threads' ranges.
+
+#define CALLCHUNK    256
+#define CALLQUEUEMAX (1 << 16)
+
+typedef struct _worker {
+  javatype *jt;
+  int id;
+  pthread_t thread;
+  resolver r;
+  uint64_t range;      // Chunks [range >> 32, range & 0xffffffff) left to do
+} worker;
+
+// Take a chunk from the front or the back of a range, which other
+// threads may be taking from at the same time
+static bool takechunk(uint64_t *range, bool front, uint32_t *chunk) {
+  uint64_t old, new;
+  uint32_t lo, hi;
+
+  old = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+  do {
+    lo = old >> 32;
+    hi = (uint32_t)old;
+    if (lo >= hi) return false;
+    if (front) { *chunk = lo; new = ((uint64_t)(lo + 1) << 32) | hi; }
+    else       { *chunk = hi - 1; new = ((uint64_t)lo << 32) | (hi - 1); }
+  } while (!__atomic_compare_exchange_n(range, &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return true;
+}
 
-  printf("\n     \033[33mjavatype\033[37m, by wyan\n");
-  printf("     ? for help\n\n");
-  if (argc > 1) {
-    fp = fopen(argv[1], "r");
-    if (!fp) {
-      ERROR("could not read file '%s': %s", argv[1], strerror(errno));
-      return 1;
+static void resolvechunk(worker *w, uint32_t chunk) {
+  javatype *jt;
+  call *c, *end;
+
+  jt = w->jt;
+  c = jt->calls + (size_t)chunk * CALLCHUNK;
+  end = c + CALLCHUNK;
+  if (end > jt->calls + jt->ncalls) end = jt->calls + jt->ncalls;
+  for (; c < end; c++) {
+    if (c->failed) continue;
+    if (!resolve(&w->r, c->name, c->caller.ctt, c->caller.rtt, c->sig, &c->bestmeth, &c->meth)) {
+      c->failed = true;
+      c->errmsg = w->r.errmsg;
     }
-    printf("\033[32mReading from file\033[37m %s\033[32m...\033[37m\n", argv[1]);
   }
-  else fp = stdin;
+}
 
-nextline:
-  errmsg = NULL;
-  if (fp == stdin) {
-    printf("> ");
-    fflush(stdout);
-    if (!fgets(line, LINEMAX+2, fp)) { fclose(fp); return 0; }
+static void workchunks(worker *w) {
+  javatype *jt;
+  uint32_t chunk;
+  int i;
+
+  jt = w->jt;
+  while (takechunk(&w->range, true, &chunk)) resolvechunk(w, chunk);
+  for (i = 1; i < jt->nthreads; i++)
+    while (takechunk(&jt->workers[(w->id + i) % jt->nthreads].range, false, &chunk))
+      resolvechunk(w, chunk);
+}
+
+static void *workerloop(void *arg) {
+  worker *w;
+  javatype *jt;
+  size_t gen;
+
+  w = arg;
+  jt = w->jt;
+  gen = 0;
+  while (1) {
+    pthread_mutex_lock(&jt->poollock);
+    while (jt->poolgen == gen && !jt->poolquit) pthread_cond_wait(&jt->poolgo, &jt->poollock);
+    if (jt->poolquit) { pthread_mutex_unlock(&jt->poollock); return NULL; }
+    gen = jt->poolgen;
+    pthread_mutex_unlock(&jt->poollock);
+
+    workchunks(w);
+
+    pthread_mutex_lock(&jt->poollock);
+    if (--jt->poolbusy == 0) pthread_cond_signal(&jt->pooldone);
+    pthread_mutex_unlock(&jt->poollock);
+  }
+}
+
+// Start the pool. Worker 0 is the calling thread itself.
+static void startpool(javatype *jt) {
+  int i;
+
+  if (jt->nthreads < 1) jt->nthreads = 1;
+  jt->workers = calloc(jt->nthreads, sizeof(worker));
+  pthread_mutex_init(&jt->poollock, NULL);
+  pthread_cond_init(&jt->poolgo, NULL);
+  pthread_cond_init(&jt->pooldone, NULL);
+  for (i = 0; i < jt->nthreads; i++) {
+    jt->workers[i].jt = jt;
+    jt->workers[i].id = i;
+    initresolver(&jt->workers[i].r, jt->u);
+    if (i) pthread_create(&jt->workers[i].thread, NULL, workerloop, jt->workers + i);
+  }
+}
+
+static void stoppool(javatype *jt) {
+  int i;
+
+  if (!jt->workers) return;
+  pthread_mutex_lock(&jt->poollock);
+  jt->poolquit = true;
+  pthread_cond_broadcast(&jt->poolgo);
+  pthread_mutex_unlock(&jt->poollock);
+  for (i = 0; i < jt->nthreads; i++) {
+    if (i) pthread_join(jt->workers[i].thread, NULL);
+    freeresolver(&jt->workers[i].r);
+  }
+  pthread_mutex_destroy(&jt->poollock);
+  pthread_cond_destroy(&jt->poolgo);
+  pthread_cond_destroy(&jt->pooldone);
+  free(jt->workers);
+  jt->workers = NULL;
+}
+
+// Parse a method call statement into the queue. A statement that does
+// not parse is queued too, so that its error comes out in order.
+static void queuecall(javatype *jt, symbol objsym) {
+  call *c;
+
+  if (jt->ncalls == jt->callcap) {
+    jt->callcap = jt->callcap ? jt->callcap << 1 : 1024;
+    jt->calls = realloc(jt->calls, jt->callcap * sizeof(call));
+  }
+  c = jt->calls + jt->ncalls++;
+  c->failed = !parse_call(jt, objsym, &c->caller, &c->name, &c->sig);
+  c->errmsg = jt->u->errmsg;
+  c->line = jt->line;
+  c->lineend = jt->lineend;
+  c->lineno = jt->lineno;
+  c->caret = jt->caret;
+}
+
+// Resolve and emit every queued call
+static void runcalls(javatype *jt) {
+  size_t nchunks, i, lineno;
+  call *c;
+
+  if (!jt->ncalls) return;
+  if (!jt->workers) startpool(jt);
+
+  nchunks = (jt->ncalls + CALLCHUNK - 1) / CALLCHUNK;
+  if (jt->nthreads == 1 || nchunks < 2 * (size_t)jt->nthreads) {
+    jt->workers[0].range = nchunks;
+    workchunks(jt->workers);
   }
   else {
-    if (!fgets(line, LINEMAX+2, fp)) { fclose(fp); return 0; }
-    printf("> %s", line);
+    for (i = 0; i < (size_t)jt->nthreads; i++)
+      jt->workers[i].range = (nchunks * i / jt->nthreads) << 32 | nchunks * (i + 1) / jt->nthreads;
+    pthread_mutex_lock(&jt->poollock);
+    jt->poolbusy = jt->nthreads - 1;
+    jt->poolgen++;
+    pthread_cond_broadcast(&jt->poolgo);
+    pthread_mutex_unlock(&jt->poollock);
+
+    workchunks(jt->workers);
+
+    pthread_mutex_lock(&jt->poollock);
+    while (jt->poolbusy) pthread_cond_wait(&jt->pooldone, &jt->poollock);
+    pthread_mutex_unlock(&jt->poollock);
+  }
+
+  lineno = jt->lineno;
+  for (c = jt->calls; c < jt->calls + jt->ncalls; c++) {
+    if (!c->failed) { emitcall(jt, &c->caller, c->name, c->sig, c->bestmeth, c->meth); continue; }
+    jt->line = c->line;
+    jt->lineend = c->lineend;
+    jt->lineno = c->lineno;
+    jt->caret = c->caret;
+    jt->u->errmsg = c->errmsg;
+    emiterror(jt);
+  }
+  jt->lineno = lineno;
+  jt->ncalls = 0;
+}
+
+// Whether [l, lend) looks like a method call statement, i.e. starts
+// with a name other than "types" followed by a '.'
+static bool iscall(char *l, char *lend) {
+  char *s;
+
+  for (; l < lend && (*l == ' ' || *l == '\t'); l++);
+  for (s = l; l < lend && *l != ' ' && *l != '\t' && !SPECIALCHAR(*l); l++);
+  if (l == s || (l - s == 5 && memcmp(s, "types", 5) == 0)) return false;
+  for (; l < lend && (*l == ' ' || *l == '\t'); l++);
+  return l < lend && *l == '.';
+}
+
+// Whether [l, lend) is save <file> or load <file>, rather than a
+// statement about a type or object called save or load: the file name
+// is a single word, with no = in it
+static bool issnapshotstmt(char *l, char *lend) {
+  char *p;
+
+  if (lend - l < 4 || (memcmp(l, "save", 4) && memcmp(l, "load", 4))) return false;
+  for (p = l + 4; p < lend && (*p == ' ' || *p == '\t'); p++);
+  if (p == l + 4 && p < lend) return false;
+  for (; p < lend && *p != ' ' && *p != '\t' && *p != '='; p++);
+  for (; p < lend && (*p == ' ' || *p == '\t'); p++);
+  return p == lend;
+}
+
+// save <file> or load <file>; see snapshot.c
+static bool snapshotstmt(javatype *jt, bool save) {
+  char *p, *pend, *path;
+  bool ok;
+  int i;
+
+  for (p = jt->line + 4; p < jt->lineend && (*p == ' ' || *p == '\t'); p++);
+  for (pend = jt->lineend; pend > p && (pend[-1] == ' ' || pend[-1] == '\t'); pend--);
+  jt->caret = p - jt->line;
+  if (p >= pend) { jt->u->errmsg = "missing file name"; return false; }
+
+  path = strndup(p, pend - p);
+  ok = save ? savesnapshot(jt->u, path) : loadsnapshot(jt->u, path);
+  free(path);
+  // Whatever the resolvers cached came from the universe just replaced
+  for (i = 0; !save && jt->workers && i < jt->nthreads; i++) resetresolver(&jt->workers[i].r);
+  return ok;
+}
+
+// Run the statement [l, lend), reporting any error. Returns false if
+// the statement asks to quit.
+
+bool execline(javatype *jt, char *l, char *lend) {
+  size_t len;
+  symbol sym1;
+  int i;
+
+  jt->u->errmsg = NULL;
+  jt->line = l;
+  jt->lineend = lend;
+  len = lend - l;
+
+  if (len && jt->line[0] == '#') return true;    // Comment
+
+  if (len && jt->line[0] == '?') {                      // Help
+    outflush(jt);
+    if (len == 1) help(jt);
+    else if (jt->line[1] == 't') dumptypes(jt->u, jt->out);
+    else if (jt->line[1] == 'o') dumpobjects(jt->u, jt->out);
+    else if (jt->line[1] == 'v') dumpvtables(jt->u, jt->out);
+    else if (jt->line[1] == 'm') dumpmemory(jt->u, jt->out);
+    else if (jt->line[1] == 'c') dumpsites(jt);
+    else fprintf(jt->out, "I don't know this help option\n");
+    return true;
   }
 
-  s = strchr(line, '\n');
-  // Either the user pressed Ctrl-D with a nonempty line, or the line
-  // was too long
-  if (!s) goto nextline;
-  // Make line null-terminated rather than \n-terminated.
-  *s = '\0';
+  if (len == 1 && jt->line[0] == 'q') return false;  // Quit
 
-  lineptr = line;
+  if (len == 5 && memcmp(jt->line, "reset", 5) == 0) {  // Drop the universe
+    resetuniverse(jt->u);
+    for (i = 0; jt->workers && i < jt->nthreads; i++) resetresolver(&jt->workers[i].r);
+    areset(&jt->sitemem);
+    htinitmem(&jt->sites, sizeof(uint32_t), &jt->sitemem);
+    return true;
+  }
 
-  if (*line == '#') goto nextline;           // Comment
+  if (len == 6 && memcmp(jt->line, "freeze", 6) == 0) {  // See runcalls()
+    freezeuniverse(jt->u);
+    return true;
+  }
+
+  if (len == 1 && jt->line[0] == '{') {    // See openscope()
+    openscope(jt->u);
+    return true;
+  }
 
-  if (line[0] == '?') {                      // Help
-    if (!line[1]) help();
-    else if (line[1] == 't') dumptypes();
-    else if (line[1] == 'o') dumpobjects();
-    else if (line[1] == 'v') dumpvtables();
-    else printf("I don't know this help option\n");
-    goto nextline;
+  if (len == 1 && jt->line[0] == '}') {
+    jt->caret = 0;
+    if (!closescope(jt->u)) goto err;
+    return true;
   }
 
-  if (line[0] == 'q' && !line[1]) return 0;  // Quit
+  if (len == 10 && memcmp(jt->line, "checkpoint", 10) == 0) {
+    checkpoint(jt->u);
+    return true;
+  }
+
+  if (len == 8 && memcmp(jt->line, "rollback", 8) == 0) {
+    jt->caret = 0;
+    if (!rollback(jt->u)) goto err;
+    // The resolvers may hold on to what was just undone
+    for (i = 0; jt->workers && i < jt->nthreads; i++) resetresolver(&jt->workers[i].r);
+    return true;
+  }
+
+  if (len == 6 && memcmp(jt->line, "commit", 6) == 0) {
+    jt->caret = 0;
+    if (!commit(jt->u)) goto err;
+    return true;
+  }
+
+  if (issnapshotstmt(jt->line, jt->lineend)) {
+    if (!snapshotstmt(jt, jt->line[0] == 's')) goto err;
+    return true;
+  }
+
+  tokenize(jt);
 
   // First two tokens tells us what kind of statement we are dealing with
 
-  if (expectstr("types")) {            // First token
-    if (expect('\0')) { errmsg = "empty type declaration"; goto err; }
-    if (!parse_typedecl()) goto err;
-    goto nextline;
+  if (expectstr(jt, "types")) {            // First token
+    if (expect(jt, '\0')) { jt->u->errmsg = "empty type declaration"; goto err; }
+    if (!parse_typedecl(jt)) goto err;
+    return true;
   }
 
-  else if (expect(NONSPECIAL)) {
-    if (expect('.')) {                 // Second token
+  // Unless batch is an object or a type being declared an object of
+  if (jt->ntoks > 2 && (jt->toks[2].kind == ',' || jt->toks[2].kind == '.') && expectstr(jt, "batch")) {
+    if (!parse_batchcall(jt)) goto err;
+    return true;
+  }
+
+  else if (expect(jt, NONSPECIAL)) {
+    sym1 = jt->toksym;
+    if (peek(jt, '.')) {                   // Second token
       type *useless;
-      lineptr = line;
-      if (!parse_methodcall(&useless)) goto err;
+      if (jt->inrun && jt->u->frozen) queuecall(jt, sym1);
+      else if (!parse_methodcall(jt, sym1, &useless)) goto err;
     }
 
-    else if (expect('=')) {
-      lineptr = line;
-      if (!parse_objectasgn()) goto err;
+    else if (peek(jt, '=')) {
+      if (!parse_objectasgn(jt, sym1)) goto err;
     }
 
-    else if (expect(':')) {
-      lineptr = line;
-      if (!parse_methoddecl()) goto err;
+    else if (peek(jt, ':')) {
+      if (!parse_methoddecl(jt, sym1)) goto err;
     }
 
-    else if (expect(NONSPECIAL)) {
-      lineptr = line;
-      if (!parse_objectdecl()) goto err;
+    else if (peek(jt, NONSPECIAL)) {
+      if (!parse_objectdecl(jt, sym1)) goto err;
     }
 
     else goto err;
@@ -474,14 +1171,342 @@ nextline:
 
   else goto err;
 
-  goto nextline;
+  return true;
 
 err:
-  printf("  ");
-  for (i = 0; i < lineptr-line; i++) putchar(' ');
-  printf("^\n");
-  if (errmsg) ERROR("%s", errmsg);
-  else        ERROR("parsing");
-  //if (fp != stdin) { fclose(fp); return 1; }
+  emiterror(jt);
+  return true;
+}
+
+// Embedding
+//
+// Define JAVATYPE_LIB before including this file to leave out main().
+// Each javatype has a universe of its own, and writes to its own
+// stream:
+//
+//   jt = jtnew(out);
+//   jtexec(jt, "types B < A", 11);   // One statement
+//   jtrun(jt, script, len);          // A whole script, as with -b
+//   jtflush(jt);
+//   jtfree(jt);
+//
+// JSON output (jt->json) is buffered until jtflush(), and text output
+// goes straight to the stream.
+//
+// jtnewover(base, out) makes one whose universe is an overlay on base
+// (see newoverlay()), e.g. the frozen universe of another javatype.
+
+static javatype *_jtnew(universe *u, FILE *out) {
+  javatype *jt;
+
+  jt = calloc(1, sizeof(javatype));
+  jt->u = u;
+  jt->out = out;
+  jt->outbuf = malloc(OUTBUFSIZE);
+  jt->nthreads = 1;
+  htinitmem(&jt->sites, sizeof(uint32_t), &jt->sitemem);
+  return jt;
+}
+
+javatype *jtnew(FILE *out) {
+  return _jtnew(newuniverse(), out);
+}
+
+javatype *jtnewover(universe *base, FILE *out) {
+  return _jtnew(newoverlay(base), out);
+}
+
+void jtflush(javatype *jt) {
+  outflush(jt);
+}
+
+void jtfree(javatype *jt) {
+  outflush(jt);
+  stoppool(jt);
+  freeuniverse(jt->u);
+  afree(&jt->sitemem);
+  free(jt->toks);
+  free(jt->calls);
+  free(jt->recvs);
+  free(jt->recvmeths);
+  free(jt->outbuf);
+  free(jt);
+}
+
+// Run one statement of len bytes. Returns false if it asks to quit.
+bool jtexec(javatype *jt, char *s, size_t len) {
+  jt->lineno++;
+  return execline(jt, s, s + len);
+}
+
+// Run the statements in text, one per line, without echoing them. The
+// last line need not end in a newline. Calls made once the universe is
+// frozen are resolved by jt->nthreads threads. Returns false if a
+// statement asks to quit, which skips the rest.
+
+bool jtrun(javatype *jt, char *text, size_t len) {
+  char *l, *lend, *end;
+  bool quit;
+
+  jt->batch = true;
+  jt->inrun = true;
+  end = text + len;
+  for (l = text, quit = false; l < end && !quit; l = lend + 1) {
+    lend = memchr(l, '\n', end - l);
+    if (!lend) lend = end;
+    if (jt->ncalls && (jt->ncalls == CALLQUEUEMAX || !iscall(l, lend))) runcalls(jt);
+    quit = !jtexec(jt, l, lend - l);
+  }
+  runcalls(jt);
+  jt->inrun = false;
+  return !quit;
+}
+
+#ifndef JAVATYPE_LIB
+// Batch mode: map the whole file and parse it in place, without
+// copying lines.
+
+int runbatch(javatype *jt, char *path) {
+  struct stat st;
+  char *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    ERROR(jt, "could not read file '%s': %s", path, strerror(errno));
+    return 1;
+  }
+  if (!st.st_size) { close(fd); return 0; }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ERROR(jt, "could not map file '%s': %s", path, strerror(errno));
+    return 1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+  jtrun(jt, map, st.st_size);
+  munmap(map, st.st_size);
+  return 0;
+}
+
+// Server mode
+//
+// `-s <socket>` builds a base universe as usual, from -l and a script
+// run as with -b (whose output goes to stderr), and freezes it. It then
+// serves sessions, each on a thread of its own: one on stdin/stdout,
+// and one for every connection to the Unix socket at <socket>. `-s -`
+// serves stdin/stdout alone, and exits at its end. Every session works
+// on an overlay on the base universe (see newoverlay()), so sessions
+// all see the base, but none sees what another declares.
+//
+// Requests and replies are frames: the length of the payload in bytes,
+// in decimal, then a newline and the payload. A request holds any
+// number of statements, one per line, run as with -b, and its reply
+// holds everything they printed. Replies come in the order of the
+// requests, so a client can send any number of requests before reading
+// the replies.
+
+typedef struct {
+  universe *base;
+  bool json;
+  int fd;              // The connection, or -1 for stdin/stdout
+} session;
+
+static void serve(session *s, FILE *in, FILE *out) {
+  javatype *jt;
+  FILE *mem;
+  char *req, *reply;
+  size_t len, cap, replylen;
+  bool quit;
+
+  jt = jtnewover(s->base, out);
+  jt->json = s->json;
+  req = NULL;
+  cap = 0;
+  quit = false;
+  while (!quit && fscanf(in, "%zu", &len) == 1 && fgetc(in) == '\n') {
+    if (len > cap) {
+      req = realloc(req, len);
+      cap = len;
+    }
+    if (fread(req, 1, len, in) != len) break;
+
+    reply = NULL;
+    mem = open_memstream(&reply, &replylen);
+    jt->out = mem;
+    quit = !jtrun(jt, req, len);
+    jtflush(jt);
+    fclose(mem);
+    jt->out = out;
+
+    fprintf(out, "%zu\n", replylen);
+    fwrite(reply, 1, replylen, out);
+    fflush(out);
+    free(reply);
+  }
+  free(req);
+  jtfree(jt);
+}
+
+static void *sessionthread(void *arg) {
+  session *s;
+  FILE *in, *out;
+
+  s = arg;
+  if (s->fd < 0) serve(s, stdin, stdout);
+  else {
+    in = fdopen(s->fd, "r");
+    out = fdopen(dup(s->fd), "w");
+    serve(s, in, out);
+    fclose(in);
+    fclose(out);
+  }
+  free(s);
+  return NULL;
+}
+
+static void startsession(javatype *jt, int fd) {
+  session *s;
+  pthread_t thread;
+
+  s = malloc(sizeof(session));
+  s->base = jt->u;
+  s->json = jt->json;
+  s->fd = fd;
+  pthread_create(&thread, NULL, sessionthread, s);
+  pthread_detach(thread);
+}
+
+int runserver(javatype *jt, char *path) {
+  struct sockaddr_un addr;
+  session s;
+  int fd, conn;
+
+  if (!jt->u->frozen) freezeuniverse(jt->u);
+  jtflush(jt);
+  fflush(stdout);
+  // A client hanging up must only end its own session
+  signal(SIGPIPE, SIG_IGN);
+
+  if (strcmp(path, "-") == 0) {
+    s = (session){jt->u, jt->json, -1};
+    serve(&s, stdin, stdout);
+    return 0;
+  }
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERROR(jt, "socket path '%s' is too long", path);
+    return 1;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+    ERROR(jt, "could not listen on '%s': %s", path, strerror(errno));
+    return 1;
+  }
+
+  startsession(jt, -1);
+  for (;;) {
+    conn = accept(fd, NULL, NULL);
+    if (conn >= 0) startsession(jt, conn);
+    else if (errno != EINTR && errno != ECONNABORTED) {
+      ERROR(jt, "could not accept on '%s': %s", path, strerror(errno));
+      return 1;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  javatype *jt;
+  FILE *fp;
+  char *buf, *s, *server;
+  size_t cap;
+  ssize_t n;
+  int ret;
+
+  jt = jtnew(stdout);
+  jt->nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  ret = 0;
+  server = NULL;
+
+  for (argv++, argc--; argc && argv[0][0] == '-'; argv++, argc--) {
+    if (strcmp(argv[0], "-j") == 0) jt->json = true;
+    else if (strcmp(argv[0], "-b") == 0) jt->batch = true;
+    else if (strcmp(argv[0], "-t") == 0 && argc > 1) { jt->nthreads = atoi(argv[1]); argv++; argc--; }
+    else if (strcmp(argv[0], "-s") == 0 && argc > 1) { server = argv[1]; argv++; argc--; }
+    else if (strcmp(argv[0], "-l") == 0 && argc > 1) {
+      if (!loadsnapshot(jt->u, argv[1])) { ERROR(jt, "%s: '%s'", jt->u->errmsg, argv[1]); ret = 1; goto done; }
+      argv++; argc--;
+    }
+    else { ERROR(jt, "unknown option '%s'", argv[0]); ret = 1; goto done; }
+  }
+  if (server) {
+    jt->out = stderr;
+    if (argc && (ret = runbatch(jt, argv[0]))) goto done;
+    jtflush(jt);             // The base's output, ahead of any frame
+    jt->out = stdout;
+    ret = runserver(jt, server);
+    goto done;
+  }
+  if (jt->batch) {
+    if (!argc) { ERROR(jt, "-b needs a file"); ret = 1; goto done; }
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    ret = runbatch(jt, argv[0]);
+    goto done;
+  }
+
+  // JSON output is for programs, so it comes without the banner, the
+  // prompt and the echo
+  if (!jt->json) {
+    printf("\n     \033[33mjavatype\033[37m, by wyan\n");
+    printf("     ? for help\n\n");
+  }
+  if (argc) {
+    fp = fopen(argv[0], "r");
+    if (!fp) {
+      ERROR(jt, "could not read file '%s': %s", argv[0], strerror(errno));
+      ret = 1;
+      goto done;
+    }
+    if (!jt->json) printf("\033[32mReading from file\033[37m %s\033[32m...\033[37m\n", argv[0]);
+  }
+  else fp = stdin;
+
+  buf = NULL;
+  cap = 0;
+
+nextline:
+  if (fp == stdin) {
+    jtflush(jt);
+    if (!jt->json) printf("> ");
+    fflush(stdout);
+    if ((n = getline(&buf, &cap, fp)) < 0) goto quit;
+  }
+  else {
+    if ((n = getline(&buf, &cap, fp)) < 0) goto quit;
+    if (!jt->json) printf("> %s", buf);
+  }
+
+  s = memchr(buf, '\n', n);
+  if (!s) {
+    // The user pressed Ctrl-D with a nonempty line
+    if (fp == stdin && isatty(0)) { jt->lineno++; goto nextline; }
+    // The last line of a file, with no newline
+    if (fp != stdin && !jt->json) printf("\n");
+    s = buf + n;
+  }
+
+  if (!jtexec(jt, buf, s - buf)) goto quit;
   goto nextline;
-}
\ No newline at end of file
+
+quit:
+  free(buf);
+  fclose(fp);
+done:
+  jtfree(jt);
+  return ret;
+}
+#endif
@@ -0,0 +1,511 @@
+// Snapshots
+//
+// A snapshot is a universe's declarations (its symbols, types,
+// signatures, methods and objects) saved to a file, so that a large
+// library of declarations only has to be checked once. Loading one
+// maps the file and builds the universe straight from it, without
+// going through creattype() and creatmethod(): nothing is checked
+// again, and the Hasse diagrams of the overloads are read back rather
+// than worked out, which is where most of creatmethod()'s time goes.
+//
+// The file is a snapheader followed by 32-bit words in native byte
+// order. Things refer to each other by their index in the file, never
+// by address, so a file can be mapped anywhere:
+//
+//   symbols   the names of symbols 1, 2, ..., each zero-terminated,
+//             padded to a whole word
+//   types     {symbol, super} for each type; super is SNAPNONE for
+//             _Root
+//   sigs      {len, type...} for signatures 1, 2, ..., by id
+//   vtables   {type, nnames} for each vtable, followed by
+//             {name, nmeths} for each of its method names, followed
+//             by {sig, rettype, slot, nup, up...} for each method.
+//             Methods are numbered in the order they appear; up is
+//             the overloads directly above it in the Hasse diagram
+//             (see sigtableadd())
+//   dispatch  only if frozen: for each type with method slots, in the
+//             order of the types, the method in each slot, or SNAPNONE
+//             (see builddispatch()). Loading puts them back as they
+//             are, rather than building them all again
+//   objects   {symbol, ctt, rtt}
+//
+// Every table is written in the order that puts its items back into
+// the same slots when loaded (see htorigin()), so that dumps of a
+// loaded universe come out exactly as those of the saved one.
+//
+// An overlay is saved together with its base, as one universe: their
+// symbols and signatures are numbered as one already, and each table
+// is written as the base's items followed by the overlay's.
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
+#include "types.c"
+
+#define SNAPMAGIC     "javatype"
+#define SNAPVERSION   3
+#define SNAPBYTEORDER 0x01020304
+#define SNAPNONE      0xffffffff   // No type
+
+typedef struct {
+  char magic[8];        // SNAPMAGIC, not zero-terminated
+  uint32_t version;
+  uint32_t byteorder;   // SNAPBYTEORDER, as the writer saw it
+  uint32_t nsyms;       // As u->syms.n
+  uint32_t symwords;    // Size of the symbols section
+  uint32_t ntypes;
+  uint32_t nsigs;       // As u->nsigs
+  uint32_t nvtables;
+  uint32_t nmeths;
+  uint32_t nobjects;
+  uint32_t frozen;
+} snapheader;
+
+// The i'th entry of ht counting from origin, wrapping around
+static hashtable_entry *snapentry(hashtable *ht, size_t origin, size_t i) {
+  return ht->entries + ((origin + i) & (ht->capacity - 1));
+}
+
+// Fill layer with the universes to save, the base first, and return
+// how many there are
+static int snaplayers(universe *u, universe **layer) {
+  int n;
+  n = 0;
+  if (u->base) layer[n++] = u->base;
+  layer[n++] = u;
+  return n;
+}
+
+// Number the methods in the order they will be written, using their
+// visited fields, and return how many there are. With clear set, put
+// 0 back in those fields instead, which _cttresolve() takes as never
+// visited.
+
+static size_t numbermethods(universe *u, bool clear) {
+  hashtable_entry *e, *e1, *e2;
+  size_t o, o1, o2, i, j, k, n;
+  universe *layer[2], *lu;
+  int nl, l;
+  vtable *vt;
+  sigtable *st;
+  method *meth;
+
+  n = 0;
+  nl = snaplayers(u, layer);
+  for (l = 0; l < nl; l++) {
+    lu = layer[l];
+    for (o = htorigin(&lu->vtables), i = 0; i < lu->vtables.capacity; i++) {
+      e = snapentry(&lu->vtables, o, i);
+      if (!e->occupied) continue;
+      vt = e->value;
+      for (o1 = htorigin(vt), j = 0; j < vt->capacity; j++) {
+        e1 = snapentry(vt, o1, j);
+        if (!e1->occupied) continue;
+        st = e1->value;
+        for (o2 = htorigin(&st->methods), k = 0; k < st->methods.capacity; k++) {
+          e2 = snapentry(&st->methods, o2, k);
+          if (!e2->occupied) continue;
+          meth = e2->value;
+          meth->visited = clear ? 0 : n;
+          n++;
+        }
+      }
+    }
+  }
+  return n;
+}
+
+static void snapput(FILE *f, uint32_t w) {
+  fwrite(&w, sizeof(w), 1, f);
+}
+
+bool savesnapshot(universe *u, char *path) {
+  FILE *f;
+  snapheader h;
+  hashtable_entry *e, *e1, *e2;
+  size_t o, o1, o2, i, j, k, n;
+  universe *layer[2], *lu;
+  int nl, l;
+  uint32_t *typeidx;    // symbol -> index of the type of that name
+  signature **sigs;     // id -> signature
+  vtable *vt;
+  sigtable *st;
+  method *meth;
+  object ob;
+  type *t;
+  bool ok;
+
+  f = fopen(path, "wb");
+  if (!f) { u->errmsg = "could not write snapshot"; return false; }
+  // Numbering the methods marks the base's as well, which overlays
+  // resolving in it must not see
+  if (u->base) pthread_mutex_lock(&u->base->lock);
+
+  nl = snaplayers(u, layer);
+  memcpy(h.magic, SNAPMAGIC, sizeof(h.magic));
+  h.version = SNAPVERSION;
+  h.byteorder = SNAPBYTEORDER;
+  h.nsyms = u->syms.n;
+  for (i = 1, n = 0; i < u->syms.n; i++) n += strlen(symname(&u->syms, i)) + 1;
+  h.symwords = (n + 3) / 4;
+  h.ntypes = h.nvtables = h.nobjects = 0;
+  for (l = 0; l < nl; l++) {
+    h.ntypes += layer[l]->types.items;
+    h.nvtables += layer[l]->vtables.items;
+  }
+  for (i = 1; i < u->syms.n; i++) h.nobjects += getobject(u, i, &ob);
+  h.nsigs = u->nsigs;
+  h.nmeths = numbermethods(u, false);
+  h.frozen = u->frozen;
+  fwrite(&h, sizeof(h), 1, f);
+
+  for (i = 1; i < u->syms.n; i++)
+    fwrite(symname(&u->syms, i), strlen(symname(&u->syms, i)) + 1, 1, f);
+  for (; n < h.symwords * 4; n++) fputc(0, f);
+
+  typeidx = calloc(u->syms.n, sizeof(uint32_t));
+  for (l = 0, n = 0; l < nl; l++) {
+    lu = layer[l];
+    for (o = htorigin(&lu->types), i = 0; i < lu->types.capacity; i++) {
+      e = snapentry(&lu->types, o, i);
+      if (e->occupied) typeidx[((type *)e->value)->sym] = n++;
+    }
+  }
+  for (l = 0; l < nl; l++) {
+    lu = layer[l];
+    for (o = htorigin(&lu->types), i = 0; i < lu->types.capacity; i++) {
+      e = snapentry(&lu->types, o, i);
+      if (!e->occupied) continue;
+      t = e->value;
+      snapput(f, t->sym);
+      snapput(f, t->super ? typeidx[t->super->sym] : SNAPNONE);
+    }
+  }
+
+  sigs = calloc(u->nsigs, sizeof(signature *));
+  for (l = 0; l < nl; l++) {
+    lu = layer[l];
+    for (e = lu->sigs.entries; e < lu->sigs.entries + lu->sigs.capacity; e++)
+      if (e->occupied) sigs[((signature *)e->value)->key[0]] = e->value;
+  }
+  for (i = 1; i < u->nsigs; i++) {
+    snapput(f, sigs[i]->len);
+    for (j = 0; j < sigs[i]->len; j++) snapput(f, typeidx[sigs[i]->types[j]->sym]);
+  }
+
+  for (l = 0; l < nl; l++) {
+    lu = layer[l];
+    for (o = htorigin(&lu->vtables), i = 0; i < lu->vtables.capacity; i++) {
+      e = snapentry(&lu->vtables, o, i);
+      if (!e->occupied) continue;
+      vt = e->value;
+      snapput(f, typeidx[keysym(e->key)]);
+      snapput(f, vt->items);
+      for (o1 = htorigin(vt), j = 0; j < vt->capacity; j++) {
+        e1 = snapentry(vt, o1, j);
+        if (!e1->occupied) continue;
+        st = e1->value;
+        snapput(f, keysym(e1->key));
+        snapput(f, st->methods.items);
+        for (o2 = htorigin(&st->methods), k = 0; k < st->methods.capacity; k++) {
+          e2 = snapentry(&st->methods, o2, k);
+          if (!e2->occupied) continue;
+          meth = e2->value;
+          snapput(f, meth->sig->key[0]);
+          snapput(f, meth->rettype ? typeidx[meth->rettype->sym] : SNAPNONE);
+          snapput(f, meth->slot);
+          snapput(f, meth->up.n);
+          for (n = 0; n < meth->up.n; n++) snapput(f, meth->up.meths[n]->visited);
+        }
+      }
+    }
+  }
+  if (h.frozen)
+    for (l = 0; l < nl; l++) {
+      lu = layer[l];
+      for (o = htorigin(&lu->types), i = 0; i < lu->types.capacity; i++) {
+        e = snapentry(&lu->types, o, i);
+        if (!e->occupied) continue;
+        t = e->value;
+        assert(!t->nslots || t->ndispatch == t->nslots);
+        for (n = 0; n < t->nslots; n++) snapput(f, t->dispatch[n] ? t->dispatch[n]->visited : SNAPNONE);
+      }
+    }
+  numbermethods(u, true);
+  if (u->base) pthread_mutex_unlock(&u->base->lock);
+
+  for (i = 1; i < u->syms.n; i++) {
+    if (!getobject(u, i, &ob)) continue;
+    snapput(f, ob.sym);
+    snapput(f, typeidx[ob.ctt->sym]);
+    snapput(f, ob.rtt ? typeidx[ob.rtt->sym] : SNAPNONE);
+  }
+
+  free(typeidx);
+  free(sigs);
+  ok = !ferror(f);
+  if (fclose(f)) ok = false;
+  if (!ok) u->errmsg = "could not write snapshot";
+  return ok;
+}
+
+// Loading reads words through a snapreader, which notes running off
+// the end, or an index out of range, in bad. Whatever was read is then
+// 0, so a record can be read whole and checked once. That is all the
+// checking done: a file that passes it can't make the loader go astray,
+// and whether the declarations in it make sense was settled when they
+// were made.
+
+typedef struct {
+  uint32_t *p;
+  uint32_t *end;
+  bool bad;
+} snapreader;
+
+static uint32_t snapget(snapreader *r) {
+  if (r->p == r->end) { r->bad = true; return 0; }
+  return *r->p++;
+}
+
+// An index below n, or SNAPNONE if none is set and it is that
+static uint32_t snapref(snapreader *r, uint32_t n, bool none) {
+  uint32_t w;
+  w = snapget(r);
+  if (w < n || (none && w == SNAPNONE)) return w;
+  r->bad = true;
+  return 0;
+}
+
+// A count of records at least minwords long each, which must all fit
+// in what is left
+static uint32_t snapcount(snapreader *r, size_t minwords) {
+  uint32_t w;
+  w = snapget(r);
+  if (w <= (r->end - r->p) / minwords) return w;
+  r->bad = true;
+  return 0;
+}
+
+static bool _loadsnapshot(universe *u, snapheader *h, snapreader *r) {
+  char *s, *send, *z;
+  uint32_t i, j, k, n, m, nnames, nmeths, sym, super, len, sigid, ret, slot, nup, up, dm, ctt, rtt;
+  type **types, *block, *t;
+  uint32_t *supers;
+  signature **sigs, *sig;
+  method *meths, *meth;
+  vtable *vt;
+  sigtable *st;
+  sigbucket *b, *ab;
+  bool ok;
+
+  types = calloc(h->ntypes, sizeof(type *));
+  supers = malloc(h->ntypes * sizeof(uint32_t));
+  sigs = calloc(h->nsigs, sizeof(signature *));
+  ok = false;
+
+  // The loaded universe stands on its own, even if u was an overlay
+  areset(&u->mem);
+  u->base = NULL;
+  cleartables(u);
+
+  // Symbols, which must come out with the same ids
+  if ((size_t)(r->end - r->p) < h->symwords) goto bad;
+  s = (char *)r->p;
+  send = s + h->symwords * 4;
+  htreserve(&u->syms.names, h->nsyms - 1);
+  for (i = 1; i < h->nsyms; i++) {
+    if (!(z = memchr(s, 0, send - s))) goto bad;
+    if (internn(&u->syms, s, z - s) != i) goto bad;
+    s = z + 1;
+  }
+  r->p += h->symwords;
+
+  // Types, linked up once they all exist
+  block = aalloc(&u->mem, h->ntypes * sizeof(type));
+  htreserve(&u->types, h->ntypes);
+  for (i = 0; i < h->ntypes; i++) {
+    sym = snapref(r, h->nsyms, false);
+    super = snapref(r, h->ntypes, true);
+    if (r->bad || !sym) goto bad;
+    if (super == SNAPNONE) {
+      if (u->root.sym) goto bad;
+      t = &u->root;
+    }
+    else t = block + i;
+    t->owner = u;
+    t->sym = sym;
+    t->name = symname(&u->syms, sym);
+    addtypeid(u, t);
+    htinsert(&u->types, symkey(&u->syms, sym), t);
+    types[i] = t;
+    supers[i] = super;
+  }
+  if (!u->root.sym) goto bad;
+  for (i = 0; i < h->ntypes; i++)
+    if (supers[i] != SNAPNONE) linktype(types[i], types[supers[i]]);
+  // A type on a cycle of super links never gets numbered
+  u->ntypes = h->ntypes;
+  numbertypes(u);
+  if (u->root.post != 2 * h->ntypes - 1) goto bad;
+
+  htreserve(&u->sigs, h->nsigs - 1);
+  for (i = 1; i < h->nsigs; i++) {
+    len = snapcount(r, 1);
+    if (r->bad) goto bad;
+    sig = aalloc(&u->mem, sizeof(signature) + (len+1) * sizeof(type *));
+    sig->key[0] = i;
+    sig->len = len;
+    for (j = 0; j < len; j++) sig->types[j] = types[snapref(r, h->ntypes, false)];
+    if (r->bad) goto bad;
+    htinsert(&u->sigs, (char *)sig->types, sig);
+    sigs[i] = sig;
+  }
+  u->nsigs = h->nsigs;
+
+  // Methods, in sigtables as sigtableadd() would leave them
+  meths = aalloc(&u->mem, h->nmeths * sizeof(method));
+  m = 0;
+  htreserve(&u->vtables, h->nvtables);
+  for (i = 0; i < h->nvtables; i++) {
+    t = types[snapref(r, h->ntypes, false)];
+    nnames = snapcount(r, 2);
+    if (r->bad) goto bad;
+    vt = aalloc(&u->mem, sizeof(vtable));
+    htinitmem(vt, sizeof(symbol), &u->mem);
+    htreserve(vt, nnames);
+    htinsert(&u->vtables, symkey(&u->syms, t->sym), vt);
+
+    for (j = 0; j < nnames; j++) {
+      sym = snapref(r, h->nsyms, false);
+      nmeths = snapcount(r, 4);
+      if (r->bad || !sym) goto bad;
+      st = aalloc(&u->mem, sizeof(sigtable));
+      htinitmem(&st->methods, sizeof(uint32_t), &u->mem);
+      htinitmem(&st->index, sizeof(uint32_t), &u->mem);
+      htreserve(&st->methods, nmeths);
+      htinsert(vt, symkey(&u->syms, sym), st);
+      t->names |= namebit(sym);
+
+      for (k = 0; k < nmeths; k++) {
+        sigid = snapref(r, h->nsigs, false);
+        ret = snapref(r, h->ntypes, true);
+        // No type has more slots than there are methods
+        slot = snapref(r, h->nmeths, false);
+        nup = snapcount(r, 1);
+        if (r->bad || !sigid || m == h->nmeths) goto bad;
+        sig = sigs[sigid];
+        meth = meths + m++;
+        meth->calltype = t;
+        meth->rettype = ret == SNAPNONE ? NULL : types[ret];
+        meth->sig = sig;
+        meth->slot = slot;
+        if (t->nslots <= slot) t->nslots = slot + 1;
+
+        meth->up.meths = aalloc(&u->mem, (nup ? nup : 1) * sizeof(method *));
+        meth->up.cap = nup ? nup : 1;
+        for (n = 0; n < nup; n++) {
+          up = snapref(r, h->nmeths, false);
+          if (r->bad) goto bad;
+          meth->up.meths[meth->up.n++] = meths + up;
+          mlpush(u, &meths[up].down, meth);
+        }
+
+        htinsert(&st->methods, (char *)sig->key, meth);
+        b = sigindex(u, st, sig->len, sig->len ? sig->types[0] : NULL, true);
+        ab = sigindex(u, st, sig->len, NULL, true);
+        if (!nup) mlpush(u, &b->tops, meth);
+        mlpush(u, &b->all, meth);
+        if (ab != b) mlpush(u, &ab->all, meth);
+      }
+    }
+  }
+  if (m != h->nmeths) goto bad;
+  inheritnames(u, &u->root);
+  // A type also has the slots of its supertypes
+  for (t = &u->root; t; t = nextinsubtree(t, &u->root))
+    if (t->super && t->super->nslots > t->nslots) t->nslots = t->super->nslots;
+
+  if (h->frozen)
+    for (i = 0; i < h->ntypes; i++) {
+      t = types[i];
+      if (!t->nslots) continue;
+      t->dispatch = aalloc(&u->mem, t->nslots * sizeof(method *));
+      t->ndispatch = t->nslots;
+      for (j = 0; j < t->nslots; j++) {
+        dm = snapref(r, h->nmeths, true);
+        if (r->bad) goto bad;
+        t->dispatch[j] = dm == SNAPNONE ? NULL : meths + dm;
+      }
+    }
+
+  for (i = 0; i < h->nobjects; i++) {
+    sym = snapref(r, h->nsyms, false);
+    ctt = snapref(r, h->ntypes, false);
+    rtt = snapref(r, h->ntypes, true);
+    if (r->bad || !sym) goto bad;
+    if (!creatobject(u, sym, types[ctt], rtt == SNAPNONE ? NULL : types[rtt])) goto bad;
+  }
+
+  if (r->p != r->end) goto bad;
+  if (h->frozen) freezeuniverse(u);
+  ok = true;
+bad:
+  free(types);
+  free(supers);
+  free(sigs);
+  return ok;
+}
+
+// Replace u with the universe saved in the snapshot at path. If the
+// file can't be used u is left as it was, unless it turns out to be
+// corrupt halfway through, in which case u is left reset.
+
+bool loadsnapshot(universe *u, char *path) {
+  struct stat st;
+  snapheader h;
+  snapreader r;
+  char *map;
+  size_t words;
+  int fd;
+  bool ok;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    u->errmsg = "could not read snapshot";
+    return false;
+  }
+  if ((size_t)st.st_size < sizeof(h) || (st.st_size - sizeof(h)) % sizeof(uint32_t)) {
+    close(fd);
+    u->errmsg = "not a snapshot";
+    return false;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { u->errmsg = "could not read snapshot"; return false; }
+
+  memcpy(&h, map, sizeof(h));
+  words = (st.st_size - sizeof(h)) / sizeof(uint32_t);
+  ok = false;
+  if (memcmp(h.magic, SNAPMAGIC, sizeof(h.magic))) u->errmsg = "not a snapshot";
+  else if (h.version != SNAPVERSION || h.byteorder != SNAPBYTEORDER)
+    u->errmsg = "snapshot was saved by another version or machine";
+  // Every count must fit in the file, so that nothing is sized from a
+  // bad one
+  else if (!h.nsyms || !h.nsigs || h.nsyms > h.symwords * 4 + 1 || h.symwords > words || h.ntypes > words / 2
+           || h.nsigs > words + 1 || h.nvtables > words / 2 || h.nmeths > words / 4 || h.nobjects > words / 3)
+    u->errmsg = "corrupt snapshot";
+  else {
+    r.p = (uint32_t *)(map + sizeof(h));
+    r.end = (uint32_t *)(map + st.st_size);
+    r.bad = false;
+    ok = _loadsnapshot(u, &h, &r);
+    if (!ok) {
+      resetuniverse(u);
+      u->errmsg = "corrupt snapshot";
+    }
+  }
+  munmap(map, st.st_size);
+  return ok;
+}
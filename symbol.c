@@ -0,0 +1,84 @@
+// Symbol table
+//
+// Every identifier (type, object and method names) is interned once
+// and from then on referred to by a dense integer id. The tables in
+// types.c are keyed on ids rather than on strings, so that resolving a
+// name never has to hash or compare it again.
+#include "common.h"
+#include "hashtable.c"
+
+typedef uint32_t symbol;   // 0 is never handed out, and means "no symbol"
+
+typedef struct {
+  char *name;
+  symbol key[2];           // {id, 0}: the symbol as a hashtable key,
+                           // for tables with keytype sizeof(symbol)
+} symbol_entry;
+
+// A table can extend a base table that no longer changes: it then
+// hands out ids following the base's, and names already in the base
+// keep their ids from there.
+
+typedef struct _symtable {
+  arena *mem;              // Where symbols are allocated
+  hashtable names;         // char * -> symbol (stored as a pointer)
+  symbol_entry **tab;      // symbol - first -> symbol_entry
+  size_t n;                // Number of ids handed out, plus one for 0
+  size_t cap;
+  struct _symtable *base;  // or NULL
+  symbol first;            // First id not from the base
+} symtable;
+
+void setupsymbols(symtable *st, arena *mem, symtable *base) {
+  st->mem = mem;
+  htinitmem(&st->names, 1, mem);
+  st->cap = 64;
+  st->tab = aalloc(mem, st->cap * sizeof(symbol_entry *));
+  st->base = base;
+  st->n = st->first = base ? base->n : 1;
+}
+
+// Intern the identifier made of the len bytes at name, which need not
+// be zero-terminated.
+
+symbol internn(symtable *st, char *name, size_t len) {
+  symbol_entry *se;
+  symbol s;
+
+  if (st->base && (s = (symbol)(uintptr_t)htfindn(&st->base->names, name, len))) return s;
+  s = (symbol)(uintptr_t)htfindn(&st->names, name, len);
+  if (s) return s;
+
+  if (st->n - st->first == st->cap) {
+    st->tab = arealloc(st->mem, st->tab, st->cap * sizeof(symbol_entry *), (st->cap << 1) * sizeof(symbol_entry *));
+    st->cap <<= 1;
+  }
+  s = st->n++;
+  se = aalloc(st->mem, sizeof(symbol_entry));
+  se->name = aalloc(st->mem, len + 1);
+  memcpy(se->name, name, len);
+  se->key[0] = s;
+  se->key[1] = 0;
+  st->tab[s - st->first] = se;
+  htinsert(&st->names, se->name, (void *)(uintptr_t)s);
+  return s;
+}
+
+symbol intern(symtable *st, char *name) {
+  return internn(st, name, strlen(name));
+}
+
+char *symname(symtable *st, symbol s) {
+  if (s < st->first) return symname(st->base, s);
+  return st->tab[s - st->first]->name;
+}
+
+char *symkey(symtable *st, symbol s) {
+  if (s < st->first) return symkey(st->base, s);
+  return (char *)st->tab[s - st->first]->key;
+}
+
+// Inverse of symkey(), for keys read back out of a table
+symbol keysym(char *key) {
+  return *(symbol *)key;
+}
@@ -1,7 +1,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "hashtable.h"
+#include "hashtable.c"
 
 hashtable ht;
 
@@ -47,4 +47,90 @@ int main() {
     }
   }
   htdump(&ht);
+
+  // TEST 3: removing every other key, then all but a few
+  size_t cap = ht.capacity;
+  for (i = 0; i < 26 * 26; i += 2)
+    assert(htremove(&ht, s+3*i) == ints+i);
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == (i % 2 ? ints+i : NULL));
+  assert(htremove(&ht, "aa") == NULL);
+  assert(ht.items == 26 * 13);
+
+  for (i = 1; i < 26 * 26 - 8; i += 2)
+    assert(htremove(&ht, s+3*i) == ints+i);
+  assert(ht.items == 4);
+  assert(ht.capacity < cap);
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == (i >= 26 * 26 - 8 && i % 2 ? ints+i : NULL));
+
+  for (i = 0; i < 26 * 26; i += 2) htinsert(&ht, s+3*i, ints+i);
+  for (i = 0; i < 26 * 26; i += 2)
+    assert(htfind(&ht, s+3*i) == ints+i);
+
+  // TEST 4: freezing, which looks keys up through a perfect hash, and
+  // thawing on the next insert
+  assert(htfreeze(&ht));
+  assert(ht.mph);
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == (i % 2 == 0 || i >= 26 * 26 - 8 ? ints+i : NULL));
+  assert(htfindn(&ht, "aaz", 2) == ints);
+  assert(htfind(&ht, "zzz") == NULL);
+  assert(htfind(&ht, "") == NULL);
+
+  for (i = 1; i < 26 * 26 - 8; i += 2) htinsert(&ht, s+3*i, ints+i);
+  assert(!ht.mph);
+  assert(ht.items == 26 * 26);
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == ints+i);
+  assert(htfreeze(&ht));
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == ints+i);
+
+  htinit(&ht, 1);
+  assert(!htfreeze(&ht));
+  assert(htfind(&ht, "aa") == NULL);
+
+  // TEST 5: freezing a table of fixed-size keys, large enough to have
+  // buckets of every size
+  uint32_t *keys = malloc(20000 * 2 * sizeof(uint32_t));
+  uint32_t miss[2];
+  htinit(&ht, sizeof(uint32_t));
+  for (i = 0; i < 20000; i++) {
+    keys[2*i] = 1 + i * 7919;
+    keys[2*i+1] = 0;
+    htinsert(&ht, (char *)(keys+2*i), ints + i % (26 * 26));
+  }
+  assert(htfreeze(&ht));
+  for (i = 0; i < 20000; i++)
+    assert(htfind(&ht, (char *)(keys+2*i)) == ints + i % (26 * 26));
+  miss[1] = 0;
+  for (i = 0; i < 20000; i++) {
+    miss[0] = 2 + i * 7919;
+    assert(htfind(&ht, (char *)miss) == NULL);
+  }
+  assert(htremove(&ht, (char *)keys) == ints);
+  assert(!ht.mph);
+  assert(htfind(&ht, (char *)keys) == NULL);
+  assert(htfind(&ht, (char *)(keys+2)) == ints+1);
+
+  // TEST 6: a table in an arena shrinks too, and rolling back brings
+  // the old storage back
+  arena mem = {0};
+  htinitmem(&ht, 1, &mem);
+  for (i = 0; i < 26 * 26; i++) htinsert(&ht, s+3*i, ints+i);
+  cap = ht.capacity;
+  acheckpoint(&mem);
+  for (i = 0; i < 26 * 26 - 4; i++)
+    assert(htremove(&ht, s+3*i) == ints+i);
+  assert(ht.items == 4);
+  assert(ht.capacity < cap);
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == (i >= 26 * 26 - 4 ? ints+i : NULL));
+  assert(arollback(&mem));
+  assert(ht.capacity == cap);
+  assert(ht.items == 26 * 26);
+  for (i = 0; i < 26 * 26; i++)
+    assert(htfind(&ht, s+3*i) == ints+i);
+  afree(&mem);
 }
\ No newline at end of file
@@ -5,328 +5,1509 @@
 // the method name and the caller's type, but I choose to overload
 // (haha) the terminology because I don't know how else to name it. I
 // hope I don't cause confusion!
+#include <pthread.h>
 #include "common.h"
-#include "hashtable.c"
+#include "symbol.c"
+
+struct _universe;
 
 struct _type {
   struct _type *super;
-  char *name;
+  symbol sym;
+  char *name;         // symname(sym)
+  uint32_t id;        // Dense id, for the object columns; see typebyid()
+  struct _universe *owner;  // The universe that declared it
+
+  // Hierarchy numbering for constant-time subtype tests: s <: t iff
+  // s's [pre, post] interval lies within t's. The tree is kept as
+  // first-child/next-sibling links so that it can be renumbered
+  // without recursion.
+  struct _type *child;
+  struct _type *next;
+  struct _type *prev;
+  size_t pre;
+  size_t post;
+
+  uint64_t names;       // Filters of the method names declared in the
+  uint64_t allnames;    // type, and in it or any of its supertypes; see
+                        // namebit()
+
+  hashtable *ctcache;   // {method name, signature id, 0} -> ctresult;
+                        // see cttresolve()
+  bool insig;           // Whether the type occurs in a cached signature
+
+  size_t nslots;              // Slots of the methods declared in it and
+                              // its supertypes; see creatmethod()
+  struct _method **dispatch;  // Flattened dispatch table, indexed by
+  size_t ndispatch;           // method slot; see rttresolve()
 };
 typedef struct _type type;
 
+typedef hashtable vtable;   // symbol (method name) -> sigtable *
+
+// A universe holds all the state of one set of declarations. Nothing
+// in this file touches anything but the universe it is given, so
+// separate universes can be used from separate threads.
+//
+// A universe can also be an overlay on a frozen base universe (see
+// newoverlay()), which it sees all of but never changes, so that any
+// number of overlays on one base can be used from separate threads.
+
+typedef struct _universe {
+  arena mem;          // Owns everything that follows: types, objects,
+                      // methods, signatures, symbols, the tables that
+                      // hold them and the caches built over them
+  symtable syms;
+
+  hashtable types;    // symbol -> type *
+  uint32_t *objctt;   // Objects, by columns indexed by the symbol of
+  uint32_t *objrtt;   // their name: the ids of their ctt and rtt, and
+  symbol *objnext;    // the next object declared in the same scope;
+  size_t objcap;      // see getobject()
+  size_t nobjects;
+                      // Three-layer hashtable of methods:
+  hashtable vtables;  // symbol  (type name)   -> vtable
+                      // symbol  (method name) -> sigtable *
+                      // signature *           -> method *
+  hashtable sigs;     // type ** (NULL-terminated) -> signature *
+  uint32_t nsigs;     // Number of signature ids handed out, plus one
+
+  type root;          // _Root
+
+  size_t ntypes;      // Number of types in the hierarchy, including _Root
+  struct _type **typetab;  // Type id - firsttypeid -> type
+  uint32_t firsttypeid;    // Ids handed out here are [firsttypeid,
+  uint32_t ntypeids;       // ntypeids); below that they are the base's
+  size_t typetabcap;
+  bool numberstale;   // Whether the pre/post numbering is out of date
+  size_t stalework;   // Super links walked since the numbering went stale
+
+  size_t visitstamp;  // Marks the overloads visited by the current _descend()
+  size_t epoch;       // Bumped by every change that may alter the outcome
+                      // of a resolution already made: new methods, moved
+                      // types, resets, loads and rollbacks
+
+  bool frozen;        // See freezeuniverse()
+  pthread_mutex_t lock;  // Taken by resolvers to call _cttresolve()
+
+  char *errmsg;       // Why the last call that failed did so
+
+  struct _universe *base;  // The universe this is an overlay on, or NULL
+  hashtable basecache;     // {ctt, method name, signature id, 0} ->
+                           // ctresult, for ctts in base; see baseresolve()
+
+  symbol *scopes;           // The last object declared in each open
+  size_t nscopes, scopecap; // scope, innermost last; see openscope()
+
+  size_t renumbers;        // Times numbertypes() has run
+  struct _universe *saved; // The universe as it was at each open
+  size_t nsaved, savedcap; // checkpoint, innermost last; see checkpoint()
+} universe;
+
+// Signatures are hash-consed: there is one immutable instance per
+// distinct parameter list, so two signatures are equal iff they are
+// the same pointer.
+
 typedef struct {
+  uint32_t key[2];    // {id, 0}: the signature as a hashtable key
+  size_t len;
+  type *types[];      // len types, followed by NULL
+} signature;
+
+typedef struct {
+  size_t n;
+  size_t cap;
+  struct _method **meths;
+} methodlist;
+
+struct _method {
   type *calltype;
   type *rettype;
-} method;
+  signature *sig;
+  size_t slot;
+
+  // Edges of the Hasse diagram of the overloads with this name and
+  // arity in calltype, ordered by morespecific()
+  methodlist up;      // Immediately less specific overloads
+  methodlist down;    // Immediately more specific overloads
+  size_t visited;     // See _cttresolve()
+};
+typedef struct _method method;
+
+static void mlpush(universe *u, methodlist *ml, method *meth) {
+  ajournal(&u->mem, ml, sizeof *ml);
+  if (ml->n == ml->cap) {
+    ml->meths = arealloc(&u->mem, ml->meths, ml->cap * sizeof(method *), (ml->cap ? ml->cap << 1 : 4) * sizeof(method *));
+    ml->cap = ml->cap ? ml->cap << 1 : 4;
+  }
+  ajournal(&u->mem, &ml->meths[ml->n], sizeof(method *));
+  ml->meths[ml->n++] = meth;
+}
+
+static void mlremove(universe *u, methodlist *ml, method *meth) {
+  size_t i;
+  for (i = 0; i < ml->n; i++) {
+    if (ml->meths[i] != meth) continue;
+    ajournal(&u->mem, ml, sizeof *ml);
+    ajournal(&u->mem, &ml->meths[i], sizeof(method *));
+    ml->meths[i] = ml->meths[--ml->n];
+    return;
+  }
+}
+
+// The overloads of one method name in one type. Besides the table of
+// all of them, they are bucketed by arity and then by the type of their
+// first parameter, so that resolution only has to look at overloads
+// whose first parameter can accept the first argument.
+//
+// Each arity also has a bucket of its own holding all its overloads,
+// keyed with a first parameter of NULL (for arity 0 this is the same
+// bucket). Within an arity the overloads form a partial order under
+// morespecific(), and resolution walks down its Hasse diagram from the
+// tops, i.e. the overloads with nothing less specific than them.
+
+typedef struct {
+  uint32_t key[3];    // {arity+1, first parameter's symbol, 0}, or
+                      // {arity+1, 0} for the whole arity
+  methodlist all;
+  methodlist tops;    // Members of all that are tops
+} sigbucket;
+
+typedef struct {
+  hashtable methods;  // signature * -> method
+  hashtable index;    // {arity+1, symbol} -> sigbucket
+} sigtable;
+
+bool morespecific(universe *u, signature *sig1, signature *sig2);
+
+// Return the bucket of overloads in st with the given arity and first
+// parameter type, creating it if create is set.
+
+static sigbucket *sigindex(universe *u, sigtable *st, size_t arity, type *first, bool create) {
+  uint32_t key[3];
+  sigbucket *b;
+
+  key[0] = arity + 1;
+  key[1] = first ? first->sym : 0;
+  key[2] = 0;
+  b = htfind(&st->index, (char *)key);
+  if (b || !create) return b;
+
+  b = aalloc(&u->mem, sizeof(sigbucket));
+  memcpy(b->key, key, sizeof(key));
+  htinsert(&st->index, (char *)b->key, b);
+  return b;
+}
 
+static sigbucket *firstbucket(universe *u, sigtable *st, method *meth) {
+  return sigindex(u, st, meth->sig->len, meth->sig->len ? meth->sig->types[0] : NULL, false);
+}
+
+static void sigtableadd(universe *u, sigtable *st, method *meth) {
+  sigbucket *b, *ab;
+  methodlist *all;
+  methodlist *up, *down;
+  method *m, *m1;
+  size_t i, j;
+
+  htinsert(&st->methods, (char *)meth->sig->key, meth);
+  b = sigindex(u, st, meth->sig->len, meth->sig->len ? meth->sig->types[0] : NULL, true);
+  ab = sigindex(u, st, meth->sig->len, NULL, true);
+  all = &ab->all;
+
+  // The new overload sits directly below the most specific overloads
+  // that are less specific than it, and directly above the least
+  // specific ones that are more specific. The lists are built in
+  // place rather than on the stack, since mlpush() journals them.
+  up = &meth->up;
+  down = &meth->down;
+  for (i = 0; i < all->n; i++) {
+    m = all->meths[i];
+    if (morespecific(u, meth->sig, m->sig)) mlpush(u, up, m);
+    else if (morespecific(u, m->sig, meth->sig)) mlpush(u, down, m);
+  }
+  for (i = 0; i < up->n; i++)
+    for (j = 0; j < up->n; j++)
+      if (i != j && morespecific(u, up->meths[j]->sig, up->meths[i]->sig)) { up->meths[i--] = up->meths[--up->n]; break; }
+  for (i = 0; i < down->n; i++)
+    for (j = 0; j < down->n; j++)
+      if (i != j && morespecific(u, down->meths[i]->sig, down->meths[j]->sig)) { down->meths[i--] = down->meths[--down->n]; break; }
+
+  // Edges between those two sets now go through the new overload
+  for (i = 0; i < up->n; i++)
+    for (j = 0; j < down->n; j++) {
+      mlremove(u, &up->meths[i]->down, down->meths[j]);
+      mlremove(u, &down->meths[j]->up, up->meths[i]);
+    }
+
+  for (i = 0; i < up->n; i++) mlpush(u, &up->meths[i]->down, meth);
+  for (i = 0; i < down->n; i++) {
+    m1 = down->meths[i];
+    if (!m1->up.n) mlremove(u, &firstbucket(u, st, m1)->tops, m1);
+    mlpush(u, &m1->up, meth);
+  }
+
+  if (!up->n) mlpush(u, &b->tops, meth);
+  mlpush(u, &b->all, meth);
+  if (ab != b) mlpush(u, all, meth);
+}
+
+// An object as read out of the columns by getobject()
 typedef struct {
   type *ctt;
-  type *rtt;
-  char *name;
+  type *rtt;          // NULL while uninitialised
+  symbol sym;
+  char *name;         // symname(sym)
 } object;
 
-hashtable TYPES;            // char * -> type *
-hashtable OBJECTS;          // char * -> object *
-                            // Three-layer hashtable of methods:
-hashtable VTABLES;          // char *  (type name)   -> vtable
-typedef hashtable vtable;   // char *  (method name) -> sigtable
-typedef hashtable sigtable; // type ** (signature)   -> method
+// The parent of t in the tree of types. That is its super, except that
+// an overlay's types whose supers are in the base hang off the
+// overlay's own _Root instead, so that the base's tree is left alone.
 
-type ROOTTYPE = {.super = NULL, .name = "_Root"};
+static type *parent(type *t) {
+  return t->super->owner == t->owner ? t->super : &t->owner->root;
+}
 
-bool issubtype(type *s, type *t) {
-  if (!t) return false;
-  for (; s; s = s->super)
-    if (s->name == t->name) return true;
-  return false;
+// Assign pre/post numbers to every type by a depth-first traversal
+// starting from _Root.
+
+static void numbertypes(universe *u) {
+  type *t;
+  size_t n;
+
+  n = 0;
+  t = &u->root;
+down:
+  t->pre = n++;
+  if (t->child) { t = t->child; goto down; }
+up:
+  t->post = n++;
+  if (t == &u->root) goto done;
+  if (t->next) { t = t->next; goto down; }
+  t = parent(t);
+  goto up;
+
+done:
+  u->numberstale = false;
+  u->stalework = 0;
+  u->renumbers++;
 }
 
-type *gettype(char *name) {
-  return htfind(&TYPES, name);
+// While types are being declared the numbering goes stale after every
+// change to the hierarchy. Renumbering each time would make a long run
+// of declarations quadratic, so until the walks done on stale numbers
+// add up to the size of the hierarchy we answer by walking the super
+// chain instead.
+//
+// Types from an overlay only ever sit below those of its base, so if t
+// is in the base, s first climbs out of the overlay, and the base's
+// numbering answers from there.
+
+bool issubtype(universe *u, type *s, type *t) {
+  if (!s || !t) return false;
+  while (s->owner != t->owner)
+    if (!(s = s->super)) return false;
+  u = t->owner;
+  if (u->numberstale) {
+    if (u->stalework < u->ntypes) {
+      for (; s; s = s->super, u->stalework++)
+        if (s == t) return true;
+      return false;
+    }
+    numbertypes(u);
+  }
+  return t->pre <= s->pre && s->post <= t->post;
 }
 
-bool creattype(char *name, char *supername) {
+// Next type after t in a depth-first traversal of the subtree rooted
+// at root, or NULL once the subtree is exhausted. Every type comes
+// after its super.
+
+static type *nextinsubtree(type *t, type *root) {
+  if (t->child) return t->child;
+  for (; t != root; t = parent(t))
+    if (t->next) return t->next;
+  return NULL;
+}
+
+// Method name filters. Each type has a one-word Bloom filter of the
+// names of the methods it declares, and another of those it or any of
+// its supertypes declares. Resolution climbing the super chain can
+// then step over the types that declare nothing by that name without
+// looking in their vtables, and give up as soon as no supertype left
+// declares it. A name's bit comes from a multiplicative hash of its
+// symbol, since symbols are handed out in sequence.
+
+static uint64_t namebit(symbol name) {
+  return (uint64_t)1 << ((uint32_t)(name * 0x9e3779b1u) >> 26);
+}
+
+// Bring the inherited filters of the subtree rooted at t up to date,
+// given that those of t's super are.
+
+static void inheritnames(universe *u, type *t) {
+  type *t1;
+  for (t1 = t; t1; t1 = nextinsubtree(t1, t)) {
+    ajournal(&u->mem, &t1->allnames, sizeof t1->allnames);
+    t1->allnames = t1->names | (t1->super ? t1->super->allnames : 0);
+  }
+}
+
+static void ctcacheclear(universe *u, type *t);
+static void ctcacheflush(universe *u);
+static void renumberslots(universe *u, type *t);
+
+static void dispatchclear(universe *u, type *t) {
+  ajournal(&u->mem, &t->dispatch, sizeof t->dispatch);
+  ajournal(&u->mem, &t->ndispatch, sizeof t->ndispatch);
+  t->dispatch = NULL;
+  t->ndispatch = 0;
+}
+
+// t and everything linked to it belong to t->owner, whose journal
+// notes the links changed
+
+static void linktype(type *t, type *super) {
+  arena *mem;
+  type *p;
+
+  mem = &t->owner->mem;
+  ajournal(mem, t, sizeof *t);
+  t->super = super;
+  p = parent(t);
+  t->prev = NULL;
+  t->next = p->child;
+  if (t->next) {
+    ajournal(mem, &t->next->prev, sizeof(type *));
+    t->next->prev = t;
+  }
+  ajournal(mem, &p->child, sizeof(type *));
+  p->child = t;
+}
+
+static void unlinktype(type *t) {
+  arena *mem;
+
+  mem = &t->owner->mem;
+  if (t->prev) {
+    ajournal(mem, &t->prev->next, sizeof(type *));
+    t->prev->next = t->next;
+  }
+  else {
+    ajournal(mem, &parent(t)->child, sizeof(type *));
+    parent(t)->child = t->next;
+  }
+  if (t->next) {
+    ajournal(mem, &t->next->prev, sizeof(type *));
+    t->next->prev = t->prev;
+  }
+}
+
+// Change the parent of an existing type; the whole subtree of t moves
+// along with it.
+
+void settypesuper(universe *u, type *t, type *super) {
+  type *t1;
+  bool insig;
+
+  // Every cached resolution made from inside the subtree may now climb
+  // a different super chain. If a moved type also appears in a cached
+  // signature, subtype tests on it change everywhere, so drop it all.
+  insig = false;
+  for (t1 = t; t1; t1 = nextinsubtree(t1, t)) {
+    insig |= t1->insig;
+    ctcacheclear(u, t1);
+    dispatchclear(u, t1);
+  }
+  if (insig) ctcacheflush(u);
+
+  unlinktype(t);
+  linktype(t, super);
+  inheritnames(u, t);
+  renumberslots(u, t);
+  u->numberstale = true;
+  u->epoch++;
+}
+
+type *gettype(universe *u, symbol name) {
+  type *t;
+  t = htfind(&u->types, symkey(&u->syms, name));
+  if (t || !u->base) return t;
+  return htfind(&u->base->types, symkey(&u->syms, name));
+}
+
+// Type ids are dense, so that the object columns can hold them in 32
+// bits. 0 is no type. An overlay carries on from its base's ids.
+
+static void addtypeid(universe *u, type *t) {
+  if (u->ntypeids - u->firsttypeid == u->typetabcap) {
+    u->typetab = arealloc(&u->mem, u->typetab, u->typetabcap * sizeof(type *), (u->typetabcap ? u->typetabcap << 1 : 16) * sizeof(type *));
+    u->typetabcap = u->typetabcap ? u->typetabcap << 1 : 16;
+  }
+  u->typetab[u->ntypeids - u->firsttypeid] = t;
+  t->id = u->ntypeids++;
+}
+
+static inline type *typebyid(universe *u, uint32_t id) {
+  if (id < u->firsttypeid) u = u->base;
+  return u->typetab[id - u->firsttypeid];
+}
+
+bool creattype(universe *u, symbol name, symbol supername) {
   type *t, *t1;
-  char *s;
-
-  t = htfind(&TYPES, supername);
-  if (!t) { errmsg = "undefined type"; return false; }
-
-  t1 = htfind(&TYPES, name);
-  if (htfind(&TYPES, name)) { errmsg = "type is already defined"; return false; }
-  t1 = malloc(sizeof(type));
-  t1->super = t;
-  s = malloc(strlen(name) + 1);
-  strcpy(s, name);
-  t1->name = s;
-  htinsert(&TYPES, s, t1);
+
+  if (u->frozen) { u->errmsg = "universe is frozen"; return false; }
+  t = gettype(u, supername);
+  if (!t) { u->errmsg = "undefined type"; return false; }
+
+  if (gettype(u, name)) { u->errmsg = "type is already defined"; return false; }
+  t1 = aalloc(&u->mem, sizeof(type));
+  t1->owner = u;
+  t1->allnames = t->allnames;
+  t1->nslots = t->nslots;
+  linktype(t1, t);
+  t1->sym = name;
+  t1->name = symname(&u->syms, name);
+  addtypeid(u, t1);
+  htinsert(&u->types, symkey(&u->syms, name), t1);
+  u->ntypes++;
+  u->numberstale = true;
   return true;
 }
 
-object *getobject(char *name) {
-  return htfind(&OBJECTS, name);
+// Return the canonical signature with the given NULL-terminated list
+// of parameter types.
+
+signature *internsig(universe *u, type **types) {
+  signature *sig;
+  size_t n;
+
+  sig = htfind(&u->sigs, (char *)types);
+  if (sig) return sig;
+  if (u->base && (sig = htfind(&u->base->sigs, (char *)types))) return sig;
+
+  for (n = 0; types[n]; n++);
+  sig = aalloc(&u->mem, sizeof(signature) + (n+1) * sizeof(type *));
+  sig->key[0] = u->nsigs++;
+  sig->key[1] = 0;
+  sig->len = n;
+  memcpy(sig->types, types, (n+1) * sizeof(type *));
+  htinsert(&u->sigs, (char *)sig->types, sig);
+  return sig;
 }
 
-bool creatobject(char *name, type *ctt, type *rtt) {
-  object *o;
-  char *s;
-  if (htfind(&OBJECTS, name)) { errmsg = "object already exists"; return false; };
-  o = malloc(sizeof(object));
-  o->ctt = ctt;
-  o->rtt = rtt;
-  s = malloc(strlen(name) + 1);
-  strcpy(s, name);
-  o->name = s;
-  htinsert(&OBJECTS, s, o);
-}
-
-bool creatmethod(char *name, type *calltype, type **sig, type *rettype) {
-  char *s;
+// Objects are kept by columns, indexed by the symbol of their name:
+// objctt and objrtt hold the ids of their types, 0 for no object and
+// for an uninitialised one respectively, and objnext chains the
+// objects of each scope. The columns of an overlay only hold the
+// objects declared or reassigned in it; getobject() looks in the base
+// for the rest. Code that goes over many objects at once (see
+// reassignobjects()) reads the columns directly.
+
+static void growobjects(universe *u, symbol name) {
+  size_t cap;
+  if (name < u->objcap) return;
+  for (cap = u->objcap ? u->objcap : 64; cap <= name; cap <<= 1);
+  u->objctt = arealloc(&u->mem, u->objctt, u->objcap * sizeof(uint32_t), cap * sizeof(uint32_t));
+  u->objrtt = arealloc(&u->mem, u->objrtt, u->objcap * sizeof(uint32_t), cap * sizeof(uint32_t));
+  u->objnext = arealloc(&u->mem, u->objnext, u->objcap * sizeof(symbol), cap * sizeof(symbol));
+  memset(u->objctt + u->objcap, 0, (cap - u->objcap) * sizeof(uint32_t));
+  memset(u->objrtt + u->objcap, 0, (cap - u->objcap) * sizeof(uint32_t));
+  memset(u->objnext + u->objcap, 0, (cap - u->objcap) * sizeof(symbol));
+  u->objcap = cap;
+}
+
+// The universe whose columns hold the object name, or NULL
+static inline universe *objectowner(universe *u, symbol name) {
+  if (name < u->objcap && u->objctt[name]) return u;
+  if (u->base && name < u->base->objcap && u->base->objctt[name]) return u->base;
+  return NULL;
+}
+
+// The ids of the ctt and rtt of the object name, or 0 for none
+static inline void objectids(universe *u, symbol name, uint32_t *ctt, uint32_t *rtt) {
+  universe *u1;
+  u1 = name < u->objcap && u->objctt[name] ? u : objectowner(u, name);
+  *ctt = u1 ? u1->objctt[name] : 0;
+  *rtt = u1 ? u1->objrtt[name] : 0;
+}
+
+bool getobject(universe *u, symbol name, object *o) {
+  universe *u1;
+  if (!(u1 = objectowner(u, name))) return false;
+  o->ctt = typebyid(u, u1->objctt[name]);
+  o->rtt = u1->objrtt[name] ? typebyid(u, u1->objrtt[name]) : NULL;
+  o->sym = name;
+  o->name = symname(&u->syms, name);
+  return true;
+}
+
+bool creatobject(universe *u, symbol name, type *ctt, type *rtt) {
+  if (objectowner(u, name)) { u->errmsg = "object already exists"; return false; };
+  growobjects(u, name);
+  ajournal(&u->mem, &u->objctt[name], sizeof(uint32_t));
+  ajournal(&u->mem, &u->objrtt[name], sizeof(uint32_t));
+  ajournal(&u->mem, &u->objnext[name], sizeof(symbol));
+  u->objctt[name] = ctt->id;
+  u->objrtt[name] = rtt ? rtt->id : 0;
+  u->objnext[name] = 0;
+  u->nobjects++;
+  if (u->nscopes) {
+    ajournal(&u->mem, &u->scopes[u->nscopes - 1], sizeof(symbol));
+    u->objnext[name] = u->scopes[u->nscopes - 1];
+    u->scopes[u->nscopes - 1] = name;
+  }
+  return true;
+}
+
+// Give the object name a new rtt, as an assignment does. An overlay
+// takes a copy of an object of its base's first, which belongs to no
+// scope.
+void setobjectrtt(universe *u, symbol name, type *rtt) {
+  universe *u1;
+  u1 = objectowner(u, name);
+  assert(u1);
+  if (u1 != u) {
+    growobjects(u, name);
+    ajournal(&u->mem, &u->objctt[name], sizeof(uint32_t));
+    u->objctt[name] = u1->objctt[name];
+    u->nobjects++;
+  }
+  ajournal(&u->mem, &u->objrtt[name], sizeof(uint32_t));
+  u->objrtt[name] = rtt->id;
+}
+
+// Give each of the n objects named in names the rtt rtt, as
+// assignments would. Like the other bulk operations on objects it goes
+// fastest with the names sorted. It stops at the first object that
+// fails, having done the ones before it.
+bool reassignobjects(universe *u, symbol *names, size_t n, type *rtt) {
+  size_t i;
+  symbol name;
+
+  for (i = 0; i < n; i++) {
+    name = names[i];
+    if (name >= u->objcap || !u->objctt[name]) {
+      if (!objectowner(u, name)) { u->errmsg = "undefined object"; return false; }
+      if (!issubtype(u, rtt, typebyid(u, u->base->objctt[name]))) goto bad;
+      setobjectrtt(u, name, rtt);
+      continue;
+    }
+    if (u->objctt[name] != rtt->id && !issubtype(u, rtt, typebyid(u, u->objctt[name]))) goto bad;
+    ajournal(&u->mem, &u->objrtt[name], sizeof(uint32_t));
+    u->objrtt[name] = rtt->id;
+  }
+  return true;
+bad:
+  u->errmsg = "rhs is not a subtype of object's ctt";
+  return false;
+}
+
+// Scopes. The objects declared while a scope is open are dropped when
+// it is closed, so that a long run of short-lived objects takes no
+// more room than the names they use. Scopes nest. Their names can be
+// declared again afterwards, so anything resolved for them is out of
+// date.
+
+void openscope(universe *u) {
+  if (u->nscopes == u->scopecap) {
+    u->scopes = arealloc(&u->mem, u->scopes, u->scopecap * sizeof(symbol), (u->scopecap ? u->scopecap << 1 : 4) * sizeof(symbol));
+    u->scopecap = u->scopecap ? u->scopecap << 1 : 4;
+  }
+  ajournal(&u->mem, &u->scopes[u->nscopes], sizeof(symbol));
+  u->scopes[u->nscopes++] = 0;
+}
+
+bool closescope(universe *u) {
+  symbol name;
+
+  if (!u->nscopes) { u->errmsg = "no scope to close"; return false; }
+  for (name = u->scopes[--u->nscopes]; name; name = u->objnext[name]) {
+    ajournal(&u->mem, &u->objctt[name], sizeof(uint32_t));
+    ajournal(&u->mem, &u->objrtt[name], sizeof(uint32_t));
+    u->objctt[name] = u->objrtt[name] = 0;
+    u->nobjects--;
+  }
+  u->epoch++;
+  return true;
+}
+
+// Compile-time resolution cache. Each type keeps a table from method
+// name and call signature to the outcome of cttresolve() made from
+// that type, including failures. A hit is a single probe, and a miss
+// allocates nothing but the entry.
+//
+// A new type cannot change any cached outcome, since it has no methods
+// and no existing object has it as a ctt. creatmethod() clears the
+// entries for its name in the subtree of the calling type, and
+// settypesuper() those of the moved subtree.
+
+typedef struct {
+  uint32_t key[4];    // The entry's key, in whichever table holds it
+  method *bestmeth;
+  char *errmsg;       // NULL if the resolution succeeded
+} ctresult;
+
+static void ctcacheclear(universe *u, type *t) {
+  if (!t->ctcache) return;
+  ajournal(&u->mem, t->ctcache, sizeof *t->ctcache);
+  htinitmem(t->ctcache, sizeof(uint32_t), &u->mem);
+}
+
+// Drop the entries of t's cache for method name. Removing an entry may
+// shift a later one back into its slot, so that slot is looked at again,
+// or shrink the table, which then has to be gone through from the start.
+static void ctcachedrop(type *t, symbol name) {
+  hashtable_entry *e, *entries;
+  if (!t->ctcache) return;
+  for (e = entries = t->ctcache->entries; e < entries + t->ctcache->capacity; )
+    if (e->occupied && ((ctresult *)e->value)->key[0] == name) {
+      htremove(t->ctcache, e->key);
+      if (t->ctcache->entries != entries) e = entries = t->ctcache->entries;
+    }
+    else e++;
+}
+
+static void ctcacheflush(universe *u) {
+  hashtable_entry *e;
+  type *t;
+  for (e = u->types.entries; e < u->types.entries + u->types.capacity; e++) {
+    if (!e->occupied) continue;
+    t = e->value;
+    ctcacheclear(u, t);
+    ajournal(&u->mem, &t->insig, sizeof t->insig);
+    t->insig = false;
+  }
+  if (u->base) htinitmem(&u->basecache, sizeof(uint32_t), &u->mem);
+}
+
+// The methods declared in t, which may be a type of the base
+static vtable *getvtable(universe *u, type *t) {
+  return htfind(&t->owner->vtables, symkey(&u->syms, t->sym));
+}
+
+// The method that a method name(sig) declared in t overrides: the one
+// of the same signature in the nearest supertype that has one, or NULL
+static method *overridden(universe *u, type *t, symbol name, signature *sig) {
   vtable *vt;
-  sigtable *st, *st1;
+  sigtable *st;
+  method *meth;
+  uint64_t bit;
+
+  bit = namebit(name);
+  for (t = t->super; t && (t->allnames & bit); t = t->super) {
+    if (!(t->names & bit)) continue;
+    if (!(vt = getvtable(u, t))) continue;
+    if (!(st = htfind(vt, symkey(&u->syms, name)))) continue;
+    if ((meth = htfind(&st->methods, (char *)sig->key))) return meth;
+  }
+  return NULL;
+}
+
+// Method slots are numbered per hierarchy, as in a JVM vtable: a type
+// has the slots of its supertypes, followed by one for each method it
+// declares that overrides none of theirs. A method that does override
+// one takes its slot. Since methods can be declared in a type after
+// its subtypes have some of their own, a new slot goes past those of
+// the whole subtree as well. Unrelated types reuse the same slots, so
+// each dispatch table only has as many as its type can use.
+
+bool creatmethod(universe *u, symbol name, type *calltype, signature *sig, type *rettype) {
+  vtable *vt;
+  sigtable *st;
   method *meth, *meth1;
-  method *overriding;
+  type *t;
+  uint64_t bit;
 
-  vt = htfind(&VTABLES, calltype->name);
-  if (!vt) {     // entry in VTABLES doesn't exist
-    vt = malloc(sizeof(vtable));
-    htinit(vt, 1);
-    htinsert(&VTABLES, calltype->name, vt);
+  if (u->frozen) { u->errmsg = "universe is frozen"; return false; }
+  if (calltype->owner != u) { u->errmsg = "cannot declare methods in a type of the base"; return false; }
+  vt = htfind(&u->vtables, symkey(&u->syms, calltype->sym));
+  if (!vt) {     // entry in vtables doesn't exist
+    vt = aalloc(&u->mem, sizeof(vtable));
+    htinitmem(vt, sizeof(symbol), &u->mem);
+    htinsert(&u->vtables, symkey(&u->syms, calltype->sym), vt);
   }
 
-  st = htfind(vt, name);
+  st = htfind(vt, symkey(&u->syms, name));
   if (!st) {     // entry in vtable doesn't exist
-    st = malloc(sizeof(sigtable));
-    htinit(st, sizeof(type *));
-    s = malloc(strlen(name) + 1);
-    strcpy(s, name);
-    htinsert(vt, s, st);
+    st = aalloc(&u->mem, sizeof(sigtable));
+    htinitmem(&st->methods, sizeof(uint32_t), &u->mem);
+    htinitmem(&st->index, sizeof(uint32_t), &u->mem);
+    htinsert(vt, symkey(&u->syms, name), st);
   }
 
-  meth = htfind(st, (char *)sig);
-  if (meth) { errmsg = "method with same signature already exists"; return false; }
-  meth = malloc(sizeof(method));
+  meth = htfind(&st->methods, (char *)sig->key);
+  if (meth) { u->errmsg = "method with same signature already exists"; return false; }
+  meth = aalloc(&u->mem, sizeof(method));
   meth->calltype = calltype;
   meth->rettype = rettype;
+  meth->sig = sig;
+  bit = namebit(name);
+
+  meth1 = overridden(u, calltype, name, sig);
+  if (meth1) {
+    // The overriding method's return type must be a subtype
+    if (!issubtype(u, rettype, meth1->rettype) && (rettype || meth1->rettype))
+      { u->errmsg = "overriding method's return type is not a subtype"; return false; }
+    meth->slot = meth1->slot;
+  }
+  else {
+    meth->slot = calltype->nslots;
+    for (t = calltype; t; t = nextinsubtree(t, calltype))
+      if (t->nslots > meth->slot) meth->slot = t->nslots;
+  }
 
-  // Find most recent parent that this method is overriding, or NULL
-try:
-  calltype = calltype->super;
-  if (!calltype) goto ret;
-  vt = htfind(&VTABLES, calltype->name);
-  if (!vt) goto try;
-  st1 = htfind(vt, name);
-  if (!st1) goto try;
-  meth1 = htfind(st1, (char *)sig);
-  if (!meth1) goto try;
-  // Found it! The overriding method's return type must be a subtype
-  if (!issubtype(rettype, meth1->rettype) && (rettype || meth1->rettype))
-    { errmsg = "overriding method's return type is not a subtype"; return false; }
-
-ret:
   // Finally add the method
-  htinsert(st, (char *)sig, meth);
+  sigtableadd(u, st, meth);
+  u->epoch++;
+
+  // Cached resolutions of this name made from the calling type or its
+  // subtypes may now pick the new method, and their dispatch tables
+  // may now have it as an override
+  calltype = meth->calltype;
+  ajournal(&u->mem, &calltype->names, sizeof calltype->names);
+  calltype->names |= bit;
+  for (t = calltype; t; t = nextinsubtree(t, calltype)) {
+    ajournal(&u->mem, &t->allnames, sizeof t->allnames);
+    t->allnames |= bit;
+    if (t->nslots <= meth->slot) {
+      ajournal(&u->mem, &t->nslots, sizeof t->nslots);
+      t->nslots = meth->slot + 1;
+    }
+    dispatchclear(u, t);
+    ctcachedrop(t, name);
+  }
   return true;
 }
 
+// Number the slots of the methods declared in the subtree rooted at t
+// over again, once it has moved: its methods may override others now,
+// or none, and new slots must go past those of the new supertypes.
+// Every type comes after its super, whose slots are then settled.
+
+static void renumberslots(universe *u, type *t) {
+  hashtable_entry *e, *e1;
+  vtable *vt;
+  sigtable *st;
+  method *meth, *meth1;
+  type *t1;
+
+  for (t1 = t; t1; t1 = nextinsubtree(t1, t)) {
+    ajournal(&u->mem, &t1->nslots, sizeof t1->nslots);
+    t1->nslots = t1->super->nslots;
+    if (!(vt = getvtable(u, t1))) continue;
+    for (e = vt->entries; e < vt->entries + vt->capacity; e++) {
+      if (!e->occupied) continue;
+      st = e->value;
+      for (e1 = st->methods.entries; e1 < st->methods.entries + st->methods.capacity; e1++) {
+        if (!e1->occupied) continue;
+        meth = e1->value;
+        meth1 = overridden(u, t1, keysym(e->key), meth->sig);
+        ajournal(&u->mem, &meth->slot, sizeof meth->slot);
+        meth->slot = meth1 ? meth1->slot : t1->nslots++;
+      }
+    }
+  }
+}
+
 // sig1 is more specific than sig2 iff they have the same length, and
 // each type in sig1 is a subtype of the corresponding type in sig2.
 
-bool morespecific(type **sig1, type **sig2) {
-  type **t, **t1;
+bool morespecific(universe *u, signature *sig1, signature *sig2) {
+  size_t i;
 
-  t = sig1, t1 = sig2;
-  while (true) {
-    if (!*t && !*t1) return true;
-    if ((*t && !*t1) || (!*t && *t1)) return false;
-    if (!issubtype(*t, *t1)) return false;
-    t++; t1++;
+  if (sig1 == sig2) return true;
+  if (sig1->len != sig2->len) return false;
+  for (i = 0; i < sig1->len; i++)
+    if (!issubtype(u, sig1->types[i], sig2->types[i])) return false;
+  return true;
+}
+
+// Walk down the Hasse diagram from meth, which matches sig, collecting
+// the most specific matching overloads in *best. Since the matching
+// overloads are closed upwards, such a walk from every matching top
+// reaches all of them. Returns false as soon as a second one turns up.
+
+static bool _descend(universe *u, method *meth, signature *sig, method **best) {
+  size_t i;
+  method *m;
+  bool minimal;
+
+  meth->visited = u->visitstamp;
+  minimal = true;
+  for (i = 0; i < meth->down.n; i++) {
+    m = meth->down.meths[i];
+    if (!morespecific(u, sig, m->sig)) continue;
+    minimal = false;
+    if (m->visited == u->visitstamp) continue;
+    if (!_descend(u, m, sig, best)) return false;
   }
+
+  if (!minimal) return true;
+  if (*best && *best != meth) return false;
+  *best = meth;
+  return true;
 }
 
+static bool baseresolve(universe *u, symbol name, type *calltype, signature *sig, method **bestmeth);
+
 // Do a compile-time resolution of method call; calltype should be the
 // ctt of the calling object.
 //
-// Returns:
-// - The most specific type defining that method, via besttype
-// - The most specific matching signature, via bestsig
+// Returns the method with the most specific matching signature, from
+// the most specific type defining one, via bestmeth.
 
-bool cttresolve(char *name, type *calltype, type **sig, type **besttype, type ***bestsig) {
+static bool _cttresolve(universe *u, symbol name, type *calltype, signature *sig, method **bestmeth) {
   vtable *vt;
   sigtable *st;
-  int i;
-  hashtable_entry *e;
-  type **cursig;
-  type **_bestsig;
+  sigbucket *b;
+  size_t i;
+  type *first;
+  method *top;
+  method *best;
+  uint64_t bit;
 
-  _bestsig = NULL;
+  bit = namebit(name);
 try:
-  vt = htfind(&VTABLES, calltype->name);
+  // Skip straight past the types that declare nothing by this name
+  if (!(calltype->allnames & bit)) { u->errmsg = "no matching signature"; return false; }
+  if (!(calltype->names & bit)) goto again;
+  if (calltype->owner != u) return baseresolve(u, name, calltype, sig, bestmeth);
+  vt = htfind(&u->vtables, symkey(&u->syms, calltype->sym));
   if (!vt) goto again;  // calltype has not defined any methods
-  st = htfind(vt, name);
+  st = htfind(vt, symkey(&u->syms, name));
   if (!st) goto again;  // calltype does not have a method of that name
 
-  // Search for most specific matching signature
-  for (i = 0, e = st->entries; i < st->capacity; i++, e++) {
-    if (!e->occupied) continue;
-    cursig = (type **)e->key;
-
-    if (morespecific(sig, cursig)) {
-      if (!_bestsig) _bestsig = cursig;
-      else if (morespecific(cursig, _bestsig)) _bestsig = cursig;
+  // Search for the most specific matching signature, starting from the
+  // matching tops. Only tops of the same arity whose first parameter
+  // is a supertype of the first argument can match.
+  best = NULL;
+  u->visitstamp++;
+  first = sig->len ? sig->types[0] : NULL;
+  do {
+    if (!(b = sigindex(u, st, sig->len, first, false))) continue;
+    for (i = 0; i < b->tops.n; i++) {
+      top = b->tops.meths[i];
+      if (top->visited == u->visitstamp || !morespecific(u, sig, top->sig)) continue;
+      // bestsig must be the unique "most specific matching signature"
+      if (!_descend(u, top, sig, &best)) { u->errmsg = "multiple matching signatures"; return false; }
     }
-  }
+  } while (first && (first = first->super));
 
-  if (!_bestsig) {      // No matching signature found
+  if (!best) {      // No matching signature found
     // Caller type does not have a method with the given name and a
     // signature that is equally or less specific; check parent types.
 again:
     calltype = calltype->super;
-    if (!calltype) { errmsg = "no matching signature"; return false; }
+    if (!calltype) { u->errmsg = "no matching signature"; return false; }
     goto try;
   }
 
-  // Check that bestsig is the unique "most specific matching signature"
-  for (i = 0, e = st->entries; i < st->capacity; i++, e++) {
-    if (!e->occupied) continue;
-    cursig = (type **)e->key;
-    if (morespecific(sig, cursig))
-      if (!morespecific(_bestsig, cursig)) { errmsg = "multiple matching signatures"; return false; }
+  *bestmeth = best;
+  return true;
+}
+
+// The rest of a resolution that has climbed from an overlay into its
+// base, or started there. An overlay can't declare methods in the
+// base's types, so the outcome is the base's; it is worked out under
+// the base's lock, since that marks the base's methods as visited, and
+// cached in the overlay, since the base's own caches must not change.
+// The signature may have types from the overlay, which issubtype()
+// takes care of.
+
+static bool baseresolve(universe *u, symbol name, type *calltype, signature *sig, method **bestmeth) {
+  universe *base;
+  uint32_t key[4];
+  ctresult *r;
+  size_t i;
+
+  base = u->base;
+  key[0] = calltype->sym;
+  key[1] = name;
+  key[2] = sig->key[0];
+  key[3] = 0;
+  r = htfind(&u->basecache, (char *)key);
+  // What the base resolved before it was frozen holds too
+  if (!r && calltype->ctcache) r = htfind(calltype->ctcache, (char *)(key + 1));
+
+  if (!r) {
+    r = aalloc(&u->mem, sizeof(ctresult));
+    memcpy(r->key, key, sizeof(key));
+    pthread_mutex_lock(&base->lock);
+    // A name the base never saw can't be one of its methods'
+    if (name >= base->syms.n) r->errmsg = "no matching signature";
+    else if (_cttresolve(base, name, calltype, sig, &r->bestmeth)) r->errmsg = NULL;
+    else r->errmsg = base->errmsg;
+    pthread_mutex_unlock(&base->lock);
+
+    for (i = 0; i < sig->len; i++)
+      if (sig->types[i]->owner == u) {
+        ajournal(&u->mem, &sig->types[i]->insig, sizeof(bool));
+        sig->types[i]->insig = true;
+      }
+    htinsert(&u->basecache, (char *)r->key, r);
   }
 
-  *besttype = calltype;
-  *bestsig = _bestsig;
+  if (r->errmsg) { u->errmsg = r->errmsg; return false; }
+  *bestmeth = r->bestmeth;
   return true;
 }
 
+// cttresolve() given the call's key in the cache of calltype and its
+// hash, which are the same from every type (see batchresolve())
+static bool cachedresolve(universe *u, symbol name, type *calltype, signature *sig, uint32_t *key, size_t hash, method **bestmeth) {
+  ctresult *r;
+  size_t i;
+
+  if (calltype->owner != u) return baseresolve(u, name, calltype, sig, bestmeth);
+  if (!calltype->ctcache) {
+    ajournal(&u->mem, &calltype->ctcache, sizeof(hashtable *));
+    calltype->ctcache = aalloc(&u->mem, sizeof(hashtable));
+    htinitmem(calltype->ctcache, sizeof(uint32_t), &u->mem);
+  }
+
+  r = htfindhash(calltype->ctcache, (char *)key, hash);
+  if (!r) {
+    r = aalloc(&u->mem, sizeof(ctresult));
+    memcpy(r->key, key, 3 * sizeof(uint32_t));
+    if (_cttresolve(u, name, calltype, sig, &r->bestmeth)) r->errmsg = NULL;
+    else r->errmsg = u->errmsg;
+
+    for (i = 0; i < sig->len; i++)
+      if (sig->types[i]->owner == u) {
+        ajournal(&u->mem, &sig->types[i]->insig, sizeof(bool));
+        sig->types[i]->insig = true;
+      }
+    htinsert(calltype->ctcache, (char *)r->key, r);
+  }
+
+  if (r->errmsg) { u->errmsg = r->errmsg; return false; }
+  *bestmeth = r->bestmeth;
+  return true;
+}
+
+bool cttresolve(universe *u, symbol name, type *calltype, signature *sig, method **bestmeth) {
+  uint32_t key[3];
+
+  key[0] = name;
+  key[1] = sig->key[0];
+  key[2] = 0;
+  return cachedresolve(u, name, calltype, sig, key, hthash((char *)key, sizeof(uint32_t)), bestmeth);
+}
+
+// Fill in the dispatch table of t: slot i holds the method that a
+// call through slot i resolves to at runtime when the caller's rtt is
+// t. The table starts as a copy of the parent's, and each method
+// defined by t then takes over its own slot as well as the slots of
+// every ancestor method it overrides. (An ancestor may have declared
+// the same signature after t did, giving it a slot of its own.)
+
+static void builddispatch(universe *u, type *t) {
+  vtable *vt, *vt1;
+  sigtable *st, *st1;
+  hashtable_entry *e, *e1;
+  method *meth, *meth1;
+  type *t1;
+  uint64_t bit;
+
+  if (t->super && t->super->nslots && !t->super->dispatch) builddispatch(u, t->super);
+  ajournal(&u->mem, &t->dispatch, sizeof t->dispatch);
+  ajournal(&u->mem, &t->ndispatch, sizeof t->ndispatch);
+  t->dispatch = aalloc(&u->mem, (t->nslots ? t->nslots : 1) * sizeof(method *));
+  t->ndispatch = t->nslots;
+  if (t->super && t->super->nslots)
+    memcpy(t->dispatch, t->super->dispatch, t->super->ndispatch * sizeof(method *));
+
+  vt = htfind(&u->vtables, symkey(&u->syms, t->sym));
+  if (!vt) return;
+  for (e = vt->entries; e < vt->entries + vt->capacity; e++) {
+    if (!e->occupied) continue;
+    st = e->value;
+    bit = namebit(keysym(e->key));
+    for (e1 = st->methods.entries; e1 < st->methods.entries + st->methods.capacity; e1++) {
+      if (!e1->occupied) continue;
+      meth = e1->value;
+      t->dispatch[meth->slot] = meth;
+
+      for (t1 = t->super; t1 && (t1->allnames & bit); t1 = t1->super) {
+        if (!(t1->names & bit)) continue;
+        if (!(vt1 = getvtable(u, t1))) continue;
+        if (!(st1 = htfind(vt1, e->key))) continue;
+        if (!(meth1 = htfind(&st1->methods, e1->key))) continue;
+        t->dispatch[meth1->slot] = meth;
+      }
+    }
+  }
+}
+
 // Do a run-time resolution of method call; calltype should be the rtt
-// of the calling object, and besttype and bestsig should come from
-// cttcompile().
+// of the calling object, and bestmeth should come from cttresolve().
+//
+// Returns the most specific override of bestmeth, via meth. Its
+// calltype is a subtype of bestmeth's.
+
+bool rttresolve(universe *u, method *bestmeth, type *calltype, method **meth) {
+  if (!issubtype(u, calltype, bestmeth->calltype)) { u->errmsg = "could not find runtime overload"; return false; }
+  if (bestmeth->slot >= calltype->ndispatch) builddispatch(u, calltype);
+  *meth = calltype->dispatch[bestmeth->slot];
+  return true;
+}
+
+// Calls over many callers at once. The callers are taken BATCHCHUNK at
+// a time, and the ids of their types loaded into flat arrays first.
+// The compile-time step is shared by all the callers with the same ctt,
+// however they are mixed: they are grouped by ctt through a small
+// open-addressed table, which only holds indices into an array of the
+// groups, so that little has to be cleared for each chunk. The run-time
+// step is done for each caller, as it costs no more than a lookup.
+
+#define BATCHCHUNK 256
+
+typedef struct {
+  uint32_t key;       // The id of the group's type
+  method *meth;
+  char *errmsg;       // Why meth is NULL
+} batchgroup;
+
+typedef struct {
+  uint16_t slot[2 * BATCHCHUNK];  // 1 + index in group, or 0 for none
+  batchgroup group[BATCHCHUNK];
+  size_t ngroups;
+  size_t mask;
+} batchtable;
+
+// Empty t, for up to m callers
+static void batchclear(batchtable *t, size_t m) {
+  for (t->mask = 3; t->mask + 1 < 2 * m; t->mask = t->mask << 1 | 1);
+  memset(t->slot, 0, (t->mask + 1) * sizeof(uint16_t));
+  t->ngroups = 0;
+}
+
+// The group of key in t. A new one only has its key set, and isnew.
+static batchgroup *batchgroupfor(batchtable *t, uint32_t key, bool *isnew) {
+  batchgroup *g;
+  size_t i;
+
+  for (i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & t->mask; t->slot[i]; i = (i + 1) & t->mask)
+    if ((g = t->group + t->slot[i] - 1)->key == key) { *isnew = false; return g; }
+  g = t->group + t->ngroups++;
+  t->slot[i] = t->ngroups;
+  g->key = key;
+  *isnew = true;
+  return g;
+}
+
+// Do rttresolve() for bestmeth with each of the n objects named in
+// names as the caller, into meths: NULL for a caller it fails for, in
+// which case u->errmsg says why. Returns the number of callers it was
+// resolved for.
+size_t dispatchobjects(universe *u, method *bestmeth, symbol *names, size_t n, method **meths) {
+  uint32_t ctt[BATCHCHUNK], rtt[BATCHCHUNK];
+  size_t i, m, nok;
+  char *errmsg;
+
+  nok = 0;
+  errmsg = NULL;
+  for (; n; names += m, meths += m, n -= m) {
+    m = n < BATCHCHUNK ? n : BATCHCHUNK;
+    for (i = 0; i < m; i++) objectids(u, names[i], &ctt[i], &rtt[i]);
+    for (i = 0; i < m; i++) {
+      if (!ctt[i] || !rtt[i]) {
+        meths[i] = NULL;
+        errmsg = ctt[i] ? "uninitialised caller" : "undefined caller";
+      } else if (rttresolve(u, bestmeth, typebyid(u, rtt[i]), &meths[i])) nok++;
+      else { meths[i] = NULL; errmsg = u->errmsg; }
+    }
+  }
+  if (errmsg) u->errmsg = errmsg;
+  return nok;
+}
+
+// Resolve the call .name(sig) with each of the n objects named in names
+// as the caller, the way a call statement would, into meths as
+// dispatchobjects() does. Callers with the same ctt share one
+// compile-time resolution, and the call's key in the types' caches is
+// hashed once for them all.
+size_t batchresolve(universe *u, symbol name, signature *sig, symbol *names, size_t n, method **meths) {
+  uint32_t ctt[BATCHCHUNK], rtt[BATCHCHUNK], key[3];
+  batchtable ctts;
+  batchgroup *c;
+  size_t i, m, nok, hash;
+  char *errmsg;
+  bool isnew;
+
+  key[0] = name;
+  key[1] = sig->key[0];
+  key[2] = 0;
+  hash = hthash((char *)key, sizeof(uint32_t));
+  nok = 0;
+  errmsg = NULL;
+  for (; n; names += m, meths += m, n -= m) {
+    m = n < BATCHCHUNK ? n : BATCHCHUNK;
+    batchclear(&ctts, m);
+    for (i = 0; i < m; i++) objectids(u, names[i], &ctt[i], &rtt[i]);
+    for (c = NULL, i = 0; i < m; i++) {
+      if (!ctt[i] || !rtt[i]) {
+        meths[i] = NULL;
+        errmsg = ctt[i] ? "uninitialised caller" : "undefined caller";
+        continue;
+      }
+      // Runs of callers with the same ctt are common, and skip the table
+      if (!c || c->key != ctt[i]) {
+        c = batchgroupfor(&ctts, ctt[i], &isnew);
+        if (isnew && !cachedresolve(u, name, typebyid(u, ctt[i]), sig, key, hash, &c->meth)) { c->meth = NULL; c->errmsg = u->errmsg; }
+      }
+      if (!c->meth) { meths[i] = NULL; errmsg = c->errmsg; }
+      else if (rttresolve(u, c->meth, typebyid(u, rtt[i]), &meths[i])) nok++;
+      else { meths[i] = NULL; errmsg = u->errmsg; }
+    }
+  }
+  if (errmsg) u->errmsg = errmsg;
+  return nok;
+}
+
+// Freeze the universe: types and methods can no longer be added or
+// moved, so that calls can be resolved from several threads at once
+// through resolvers. Everything resolution would otherwise build
+// lazily is built now: the numbering, and the dispatch table of every
+// type that declares or inherits a method (the others have no slots,
+// and no call can dispatch through them). Tables already built, such
+// as those read back from a snapshot, are kept.
 //
-// Returns:
-// - The method, via meth.
-// - The type (a subtype of besttype) defining the most specific
-//   override for bestsig, via bestbesttype.
+// The name tables are frozen as well, which gives them perfect hashes
+// (see htfreeze()). Objects can still be declared.
 
-bool rttresolve(char *name, type *calltype, type *besttype, type **bestsig, type **bestbesttype, method **meth) {
+void freezeuniverse(universe *u) {
+  hashtable_entry *e, *e1;
   vtable *vt;
   sigtable *st;
-  method *_meth;
+  type *t;
 
-try:
-  vt = htfind(&VTABLES, calltype->name);
-  if (!vt) goto again;     // calltype has not defined any methods
-  st = htfind(vt, name);
-  if (!st) goto again;     // calltype does not have a method of that name
-  _meth = htfind(st, (char *)bestsig); // calltype does not define an override for method with bestsig
-  if (!_meth) goto again;
-  *bestbesttype = calltype;
-  *meth = _meth;
-  return true;
+  if (u->numberstale) numbertypes(u);
+  for (e = u->types.entries; e < u->types.entries + u->types.capacity; e++) {
+    if (!e->occupied) continue;
+    t = e->value;
+    if (t->nslots && !t->dispatch) builddispatch(u, t);
+  }
 
-again:
-  calltype = calltype->super;
-  if (!issubtype(calltype, besttype)) { errmsg = "could not find runtime overload"; return false; }
-  goto try;
+  htfreeze(&u->syms.names);
+  htfreeze(&u->types);
+  htfreeze(&u->sigs);
+  htfreeze(&u->vtables);
+  for (e = u->vtables.entries; e < u->vtables.entries + u->vtables.capacity; e++) {
+    if (!e->occupied) continue;
+    vt = e->value;
+    htfreeze(vt);
+    for (e1 = vt->entries; e1 < vt->entries + vt->capacity; e1++) {
+      if (!e1->occupied) continue;
+      st = e1->value;
+      htfreeze(&st->methods);
+      htfreeze(&st->index);
+    }
+  }
+  u->frozen = true;
 }
 
-void dumptypes() {
+// A resolver resolves calls over a frozen universe on behalf of one
+// thread. Any number of resolvers can work on the same universe at
+// once, as long as nothing else does: they only read the types'
+// resolution caches, and keep the resolutions they make themselves in
+// one of their own. Only a miss in both takes the universe's lock.
+
+typedef struct {
+  universe *u;
+  arena mem;          // Owns cache
+  hashtable cache;    // {ctt, method name, signature id, 0} -> ctresult
+  char *errmsg;
+} resolver;
+
+void initresolver(resolver *r, universe *u) {
+  r->u = u;
+  htinitmem(&r->cache, sizeof(uint32_t), &r->mem);
+}
+
+// Forget everything cached, for when the universe is reset
+void resetresolver(resolver *r) {
+  areset(&r->mem);
+  htinitmem(&r->cache, sizeof(uint32_t), &r->mem);
+}
+
+void freeresolver(resolver *r) {
+  afree(&r->mem);
+}
+
+// cttresolve() from ctt and then rttresolve() from rtt, in one go
+bool resolve(resolver *r, symbol name, type *ctt, type *rtt, signature *sig, method **bestmeth, method **meth) {
+  universe *u;
+  uint32_t key[4];
+  ctresult *res;
+
+  u = r->u;
+  assert(u->frozen);
+  key[0] = ctt->sym;
+  key[1] = name;
+  key[2] = sig->key[0];
+  key[3] = 0;
+  res = htfind(&r->cache, (char *)key);
+  if (!res && ctt->ctcache) res = htfind(ctt->ctcache, (char *)(key + 1));
+
+  if (!res) {
+    res = aalloc(&r->mem, sizeof(ctresult));
+    memcpy(res->key, key, sizeof(key));
+    pthread_mutex_lock(&u->lock);
+    if (_cttresolve(u, name, ctt, sig, &res->bestmeth)) res->errmsg = NULL;
+    else res->errmsg = u->errmsg;
+    pthread_mutex_unlock(&u->lock);
+    htinsert(&r->cache, (char *)res->key, res);
+  }
+  if (res->errmsg) { r->errmsg = res->errmsg; return false; }
+
+  // As rttresolve(), but the dispatch tables are all built already
+  *bestmeth = res->bestmeth;
+  if (!issubtype(u, rtt, res->bestmeth->calltype)) { r->errmsg = "could not find runtime overload"; return false; }
+  *meth = rtt->dispatch[res->bestmeth->slot];
+  return true;
+}
+
+// An overlay's dumps start with those of its base
+
+void dumptypes(universe *u, FILE *out) {
   hashtable_entry *e;
   size_t i;
   type *t;
 
-  for (i = 0; i < TYPES.capacity; i++) {
-    e = TYPES.entries + i;
+  if (u->base) dumptypes(u->base, out);
+
+  for (i = 0; i < u->types.capacity; i++) {
+    e = u->types.entries + i;
     if (e->occupied) {
       t = e->value;
       if (t->super)
-	printf("- %s <: %s\n", t->name, t->super->name);
+	fprintf(out, "- %s <: %s\n", t->name, t->super->name);
       else
-	printf("- %s\n", t->name);
+	fprintf(out, "- %s\n", t->name);
     }
   }
 }
 
-void dumpobjects() {
-  hashtable_entry *e;
-  size_t i;
-  object *o;
+void dumpobjects(universe *u, FILE *out) {
+  symbol name;
+  object o;
 
-  for (i = 0; i < OBJECTS.capacity; i++) {
-    e = OBJECTS.entries + i;
-    if (e->occupied) {
-      o = e->value;
-      printf("- %s : %s (rtt=%s)\n", o->name, o->ctt->name, o->rtt->name);
-    }
+  for (name = 1; name < u->syms.n; name++) {
+    if (!getobject(u, name, &o)) continue;
+    fprintf(out, "- %s : %s (rtt=%s)\n", o.name, o.ctt->name, o.rtt->name);
   }
 }
 
-void dumpsig(type **sig) {
+void dumpsig(FILE *out, signature *sig) {
   type **t;
-  for (t = sig; *t; t++) printf("%s,", (*t)->name);
-  printf("\b");
+  for (t = sig->types; *t; t++) fprintf(out, t == sig->types ? "%s" : ",%s", (*t)->name);
 }
 
-void dumpparams(object **params, int n) {
+void dumpparams(universe *u, FILE *out, object *params, int n) {
   int i;
   object *o;
   for (i = 0; i < n; i++) {
-    o = params[i];
-    assert(!o->rtt || issubtype(o->rtt, o->ctt));
-    if (o->rtt != o->ctt) printf("(%s)", o->ctt->name);
-    printf("%s,", o->name);
+    o = &params[i];
+    assert(!o->rtt || issubtype(u, o->rtt, o->ctt));
+    if (i) fprintf(out, ",");
+    if (o->rtt != o->ctt) fprintf(out, "(%s)", o->ctt->name);
+    fprintf(out, "%s", o->name);
   }
-  printf("\b");
 }
 
-void dumpvtables() {
+void dumpvtables(universe *u, FILE *out) {
   hashtable_entry *e, *e1, *e2;
   vtable *vt;
   sigtable *st;
 
-  char *methodname;
-  type **sig;
+  if (u->base) dumpvtables(u->base, out);
+
+  symbol methodname;
   method *meth;
-  type *t;
 
   size_t i, j, k;
 
-  for (i = 0; i < VTABLES.capacity; i++) {
-    e = VTABLES.entries + i;
+  for (i = 0; i < u->vtables.capacity; i++) {
+    e = u->vtables.entries + i;
     if (!e->occupied) continue;
     vt = e->value;
 
     for (j = 0; j < vt->capacity; j++) {
       e1 = vt->entries + j;
       if (!e1->occupied) continue;
-      methodname = e1->key;
+      methodname = keysym(e1->key);
       st = e1->value;
 
-      for (k = 0; k < st->capacity; k++) {
-        e2 = st->entries + k;
+      for (k = 0; k < st->methods.capacity; k++) {
+        e2 = st->methods.entries + k;
         if (!e2->occupied) continue;
 
-        sig = (type **)e2->key;
         meth = e2->value;
 
-        printf("- %s::%s(", meth->calltype->name, methodname);
-        dumpsig(sig);
-        if (meth->rettype) printf(") -> %s\n", meth->rettype->name);
-        else printf(")\n");
+        fprintf(out, "- %s::%s(", meth->calltype->name, symname(&u->syms, methodname));
+        dumpsig(out, meth->sig);
+        if (meth->rettype) fprintf(out, ") -> %s\n", meth->rettype->name);
+        else fprintf(out, ")\n");
       }
     }
   }
 }
 
-void setuptypes() {
-  htinit(&TYPES, 1);
-  htinit(&OBJECTS, 1);
-  htinit(&VTABLES, 1);
-  htinsert(&TYPES, "_Root", &ROOTTYPE);
-  creattype("Object", "_Root");
-  creattype("int", "_Root");
-  creattype("char", "_Root");
-  creattype("float", "_Root");
-  creattype("double", "_Root");
-  creattype("boolean", "_Root");
-}
\ No newline at end of file
+void dumpmemory(universe *u, FILE *out) {
+  fprintf(out, "- %zu bytes in use, high-water mark %zu bytes, %zu bytes reserved\n",
+         u->mem.inuse, u->mem.highwater, u->mem.reserved);
+}
+
+// Empty tables, without even _Root in them. An overlay carries on
+// numbering symbols and signatures from where its base stopped.
+
+static void cleartables(universe *u) {
+  setupsymbols(&u->syms, &u->mem, u->base ? &u->base->syms : NULL);
+  htinitmem(&u->types, sizeof(symbol), &u->mem);
+  htinitmem(&u->vtables, sizeof(symbol), &u->mem);
+  htinitmem(&u->sigs, sizeof(type *), &u->mem);
+  htinitmem(&u->basecache, sizeof(uint32_t), &u->mem);
+  u->nsigs = u->base ? u->base->nsigs : 1;
+  u->frozen = false;
+  u->root = (type){0};
+  u->root.owner = u;
+  u->ntypes = 1;
+  u->numberstale = true;
+  u->typetab = NULL;
+  u->typetabcap = 0;
+  u->firsttypeid = u->ntypeids = u->base ? u->base->ntypeids : 1;
+  u->objctt = u->objrtt = NULL;
+  u->objnext = NULL;
+  u->objcap = u->nobjects = 0;
+  u->scopes = NULL;
+  u->nscopes = u->scopecap = 0;
+  u->nsaved = 0;
+  u->epoch++;
+}
+
+// An overlay's _Root only holds its types whose supers are in the base
+// (see parent()), and it has no builtin types of its own.
+
+void setuptypes(universe *u) {
+  symbol root;
+
+  cleartables(u);
+  if (u->base) return;
+  root = intern(&u->syms, "_Root");
+  u->root.sym = root;
+  u->root.name = symname(&u->syms, root);
+  addtypeid(u, &u->root);
+  htinsert(&u->types, symkey(&u->syms, root), &u->root);
+  creattype(u, intern(&u->syms, "Object"), root);
+  creattype(u, intern(&u->syms, "int"), root);
+  creattype(u, intern(&u->syms, "char"), root);
+  creattype(u, intern(&u->syms, "float"), root);
+  creattype(u, intern(&u->syms, "double"), root);
+  creattype(u, intern(&u->syms, "boolean"), root);
+}
+
+// Drop the whole universe at once. Apart from setting up the builtin
+// types again this is O(1), since everything lives in u->mem. An
+// overlay is left empty, still on its base.
+
+void resetuniverse(universe *u) {
+  areset(&u->mem);
+  setuptypes(u);
+}
+
+// Checkpoints. checkpoint() notes where u is, and rollback() takes it
+// back there, undoing every declaration made since: types, supers,
+// objects, methods and whatever was cached along the way. The tables
+// and the objects in them all live in u->mem, whose journal records
+// the bytes each change overwrites (see acheckpoint()), so a rollback
+// takes time in proportion to what it undoes rather than to the size
+// of u. The fields of u itself are simply copied aside.
+//
+// The numbering is the one thing not journaled, since renumbering
+// rewrites every type; if it was redone since the checkpoint it is
+// just marked stale again.
+//
+// Checkpoints nest, and commit() drops the innermost one, keeping
+// everything done since. Resetting or loading u drops them all.
+
+void checkpoint(universe *u) {
+  if (u->nsaved == u->savedcap) {
+    u->savedcap = u->savedcap ? u->savedcap << 1 : 4;
+    u->saved = realloc(u->saved, u->savedcap * sizeof(universe));
+  }
+  u->saved[u->nsaved++] = *u;
+  acheckpoint(&u->mem);
+}
+
+bool rollback(universe *u) {
+  universe *s;
+
+  if (!u->nsaved) { u->errmsg = "no checkpoint to roll back to"; return false; }
+  s = &u->saved[--u->nsaved];
+  arollback(&u->mem);
+  u->syms = s->syms;
+  u->types = s->types;
+  u->objctt = s->objctt;
+  u->objrtt = s->objrtt;
+  u->objnext = s->objnext;
+  u->objcap = s->objcap;
+  u->nobjects = s->nobjects;
+  u->vtables = s->vtables;
+  u->sigs = s->sigs;
+  u->nsigs = s->nsigs;
+  u->root = s->root;
+  u->ntypes = s->ntypes;
+  u->typetab = s->typetab;
+  u->ntypeids = s->ntypeids;
+  u->typetabcap = s->typetabcap;
+  u->numberstale = s->numberstale || s->renumbers != u->renumbers;
+  u->stalework = s->stalework;
+  u->frozen = s->frozen;
+  u->basecache = s->basecache;
+  u->scopes = s->scopes;
+  u->nscopes = s->nscopes;
+  u->scopecap = s->scopecap;
+  u->epoch++;
+  return true;
+}
+
+bool commit(universe *u) {
+  if (!u->nsaved) { u->errmsg = "no checkpoint to commit"; return false; }
+  u->nsaved--;
+  acommit(&u->mem);
+  return true;
+}
+
+universe *newuniverse() {
+  universe *u;
+  u = calloc(1, sizeof(universe));
+  pthread_mutex_init(&u->lock, NULL);
+  setuptypes(u);
+  return u;
+}
+
+// A new universe that starts out with everything declared in base,
+// which must be frozen and stay alive and unchanged for as long as the
+// overlay does. Whatever is declared in the overlay only goes into the
+// overlay, and it can't declare methods in the base's types, so that
+// the base's resolutions stand. Overlays on the same base can be used
+// from separate threads.
+
+universe *newoverlay(universe *base) {
+  universe *u;
+  assert(base->frozen && !base->base);
+  u = calloc(1, sizeof(universe));
+  pthread_mutex_init(&u->lock, NULL);
+  u->base = base;
+  setuptypes(u);
+  return u;
+}
+
+void freeuniverse(universe *u) {
+  pthread_mutex_destroy(&u->lock);
+  afree(&u->mem);
+  free(u->saved);
+  free(u);
+}